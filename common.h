@@ -5,6 +5,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,24 +14,135 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "evloop.h"
+#include "mpsc.h"
+#include "sim.h"
+#include "timer.h"
+#include "workpool.h"
+
 #define MAX_COMMAND_LENGTH 16
 #define AUTOMATED_FILENAME 512
+#define DEFAULT_WINDOW_SIZE 8
+#define DEFAULT_ACK_EVERY 2
+#define DEFAULT_ACK_DELAY_USEC 500
 typedef unsigned char uchar_t;
 
+// Recover the struct that embeds the given member
+#define container_of(ptr, type, member)                                       \
+    ((type*) ((char*) (ptr) - offsetof(type, member)))
+
+// Sequence numbers are SEQ_BITS wide and wrap around; compare them only with
+// the serial-number helpers in util.h. 8 bits (the default) saves a header
+// byte per frame; building with SEQ_BITS=16 allows larger windows.
+#ifndef SEQ_BITS
+#define SEQ_BITS 8
+#endif
+#if SEQ_BITS == 8
+typedef uint8_t seq_t;
+#elif SEQ_BITS == 16
+typedef uint16_t seq_t;
+#else
+#error "SEQ_BITS must be 8 or 16: a wider seqNum does not fit in a 64-byte frame"
+#endif
+#define SEQ_SPACE (1L << SEQ_BITS)
+#define MAX_SEQ ((seq_t) (SEQ_SPACE - 1))
+
+// Countdown latch: latch_wait blocks until count_down has been called count
+// times
+struct Latch_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    int count;
+};
+typedef struct Latch_t Latch;
+
+// Retransmission strategy, selected with -p
+enum ArqMode { arq_go_back_n, arq_selective_repeat };
+
+// How many frames a sender keeps in flight per receiver, selected with -cc:
+// always the send window, or an AIMD congestion window bounded by it
+enum CongestionControl { cc_fixed, cc_aimd };
+
+// Wire formats (-f); frame_encode and frame_decode convert between them and
+// Frame, and every wire frame ends in its CRC.
+// Plain: flags, seqNum, src_id, dst_id and msg_len, big-endian. Data frames
+// of a message too long for one frame add msg_id, and past the first
+// fragment set PLAIN_CONTINUED in flags and carry their offset in place of
+// msg_len.
+// Packed: one type byte, seqNum, then src_id, dst_id and msg_id as varints;
+// the first fragment adds msg_len and the others their offset, and an ACK
+// the seqNum that triggered it.
+// Data fills the rest of either, never less than FRAME_MIN_PAYLOAD_SIZE bytes.
+enum WireFormat { wire_plain, wire_packed };
+
 // System configuration information
 struct SysConfig_t {
     float drop_prob;
     float corrupt_prob;
     unsigned char automated;
     char automated_file[AUTOMATED_FILENAME];
+    enum ArqMode arq_mode;
+    enum CongestionControl congestion_control;
+    int send_window_size;
+    int recv_window_size;
+    // Deliver frames only to the endpoint they are addressed to (-u)
+    unsigned char unicast;
+    // Use the lock-free inboxes instead of the mutex-protected lists (-i)
+    unsigned char lockfree_inbox;
+    // Wait in epoll on the inbox eventfd and a timerfd (-e epoll); implies
+    // lockfree_inbox
+    unsigned char epoll_backend;
+    // Run endpoints as tasks on pool_workers threads (-w) instead of one
+    // thread each; implies lockfree_inbox. 0 workers means one per CPU.
+    unsigned char worker_pool;
+    int pool_workers;
+    // Single-threaded discrete-event run on a virtual clock (--simulate);
+    // endpoints run as tasks and the link draws from a PRNG seeded with seed
+    unsigned char simulate;
+    unsigned long seed;
+    // Frame layout on the link (-f)
+    enum WireFormat wire_format;
+    // Delayed ACKs: one cumulative ACK per ack_every in-order frames (-ackn)
+    // or after ack_delay_usec (-ackt), whichever comes first
+    int ack_every;
+    long ack_delay_usec;
+    // Directory received files are created in (-o), NULL for the current one
+    const char* output_dir;
 };
 typedef struct SysConfig_t SysConfig;
 
-// Command line input information
+// Longest message a receiver will reassemble in memory; file transfers are
+// written out as they arrive
+#define MAX_MESSAGE_SIZE (1u << 24)
+// File bytes per message of a file transfer. Each message starts with the
+// file's base name (empty after the first), its NUL and a byte that is 1
+// while more messages of the file follow, so files of any size fit the
+// 32-bit msg_len and offset.
+#ifndef FILE_CHUNK_SIZE
+#define FILE_CHUNK_SIZE (1u << 30)
+#endif
+// How much of a file transfer a receiver stages before each pwrite
+#define FILE_WRITE_BUFFER_SIZE (1u << 16)
+
+// Command line input information. The message is length bytes, binary-safe
+// and need not be NUL-terminated. For the file command (file set) message
+// only holds the head of the current chunk, and the contents follow from map.
 struct Cmd_t {
     uint16_t src_id;
     uint16_t dst_id;
     char* message;
+    uint32_t length;
+    unsigned char file;
+    char* map;
+    uint64_t map_length;
+    // A file goes out as a chain of messages of up to FILE_CHUNK_SIZE bytes
+    // of it each; length covers the current one, which starts chunk_start
+    // bytes into the file behind a head_length-byte head in message
+    uint64_t chunk_start;
+    uint32_t head_length;
+    // Sender only: the message's msg_id, and the first byte not yet framed
+    uint16_t msg_id;
+    uint32_t offset;
 };
 typedef struct Cmd_t Cmd;
 
@@ -46,26 +158,245 @@ struct LLnode_t {
 };
 typedef struct LLnode_t LLnode;
 
-#define MAX_FRAME_SIZE 64
+// List header that caches its length, so depth checks are O(1)
+struct LLlist_t {
+    LLnode* head;
+    int length;
+};
+typedef struct LLlist_t LLlist;
 
-// TODO: You should change this!
-// Remember, your frame can be AT MOST 64 bytes!
-// In project 1, the FRAME_PAYLOAD_SIZE should be larger than 48!
-#define FRAME_PAYLOAD_SIZE 48
+#define MAX_FRAME_SIZE 64
 #define CRC_SIZE 4
 #define CRC_GENERATOR 0x82608EDB80
 // #define CRC_GENERATOR 0b1000001001100000100011101101101110000000
+
+#define FRAME_DATA_CAPACITY (MAX_FRAME_SIZE - CRC_SIZE)
+// Headers of the plain wire format (see enum WireFormat): every frame, and a
+// fragment of a message longer than PLAIN_SINGLE_FRAME_SIZE
+#define PLAIN_HEADER_SIZE (1 + SEQ_BITS / 8 + 2 + 2 + 4)
+#define PLAIN_FRAGMENT_HEADER_SIZE (PLAIN_HEADER_SIZE + 2)
+#define PLAIN_SINGLE_FRAME_SIZE (FRAME_DATA_CAPACITY - PLAIN_HEADER_SIZE)
+#define PLAIN_CONTINUED 0x80
+// Payload of a plain fragment: 48 bytes with 8-bit seqNums, as in the
+// original fixed layout
+#define FRAME_PAYLOAD_SIZE (FRAME_DATA_CAPACITY - PLAIN_FRAGMENT_HEADER_SIZE)
+// Longest packed data header (16-bit ids and msg_id, 32-bit offset), so the
+// least any frame carries
+#define PACKED_MAX_HEADER_SIZE (1 + SEQ_BITS / 8 + 3 + 3 + 3 + 5)
+#define FRAME_MIN_PAYLOAD_SIZE (FRAME_DATA_CAPACITY - PACKED_MAX_HEADER_SIZE)
+
+// Data frames (flags 'd', or 'f' for a file transfer) carry data_length bytes
+// of message msg_id, which is msg_len bytes long, starting at offset; see
+// frame_capacity for how many fit. Decoded frames past the first fragment of
+// a message have msg_len 0, plain messages that fit one frame have msg_id 0,
+// and data_length is what the frame had room for (the last fragment is
+// padded). ACK frames (flags 'a') carry the
+// cumulative ACK in seqNum and the seqNum of the data frame that triggered
+// them in msg_len. Their data is a SACK bitmap of the frames the receiver
+// holds beyond the cumulative ACK: bit i (byte i / 8, LSB first) stands for
+// frame seqNum + 1 + i.
 struct Frame_t {
-    unsigned char flags;            // 1
-    uint8_t seqNum;                 // 1 
-    uint16_t src_id;                // 2
-    uint16_t dst_id;                // 2
-    uint32_t msg_len;               // 4
-    char data[FRAME_PAYLOAD_SIZE];  // 48
-    uint32_t remainder;             // 4
+    unsigned char flags;
+    seq_t seqNum;
+    uint16_t src_id;
+    uint16_t dst_id;
+    uint32_t msg_len;
+    uint32_t offset;
+    uint16_t msg_id;
+    uint16_t data_length;
+    char data[FRAME_DATA_CAPACITY];
+    // Set by frame_decode: 0 iff the CRC matched
+    uint32_t remainder;
 };
 typedef struct Frame_t Frame;
 
+// Open-addressing map from an endpoint id to that peer's state (or from a
+// msg_id to its reassembly). It grows by doubling, so an endpoint only pays
+// for the peers it actually talks to.
+struct PeerTable_t {
+    uint16_t* keys;
+    // NULL marks an empty bucket
+    void** values;
+    uint32_t mask;
+    uint32_t length;
+};
+typedef struct PeerTable_t PeerTable;
+
+// A sender window entry: the frame in flight plus its Selective Repeat state
+struct WindowSlot_t {
+    Frame frame;
+    TimerEntry timer;
+    // RTO the timer was armed with (Selective Repeat)
+    long timer_rto_usec;
+    long sent_usec;
+    unsigned char acked;
+    unsigned char retransmitted;
+};
+typedef struct WindowSlot_t WindowSlot;
+
+// A receiver window entry holding a frame that arrived out of order
+struct RecvSlot_t {
+    Frame frame;
+    unsigned char present;
+};
+typedef struct RecvSlot_t RecvSlot;
+
+// Send-side state for one receiver. Every (sender, receiver) pair has its own
+// sequence space, so a receiver only ever sees the frames meant for it.
+struct SendPeer_t {
+    seq_t LFS;
+    seq_t LAR;
+    // In-flight frames live inline in a power-of-two ring indexed by
+    // seqNum & window_mask, so lookup and sliding are both O(1)
+    WindowSlot* window_ring;
+    // Go-Back-N only: fires for the oldest unacknowledged frame, and the RTO
+    // it was armed with
+    TimerEntry timer;
+    long timer_rto_usec;
+    // ACKs in a row that did not move the window
+    uint32_t dup_acks;
+    // Frames in the window the receiver acknowledged out of order
+    uint32_t sacked;
+    // AIMD congestion window in frames, its slow start threshold, and the
+    // frames acknowledged toward the next additive increase
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t cwnd_acked;
+    // After a loss the window is not cut again until LAR reaches recover
+    unsigned char in_recovery;
+    seq_t recover;
+    // When the pacer lets the next new frame go
+    long next_send_usec;
+    // Commands for this receiver not fully sent, and the next peer on the
+    // sender's ready list while there are any
+    LLlist pending_cmds;
+    struct SendPeer_t* ready_next;
+};
+typedef struct SendPeer_t SendPeer;
+
+// A message being put back together: each fragment is copied straight to
+// its offset, and the message is complete once received reaches length
+struct Reassembly_t {
+    char* buffer;
+    uint32_t length;
+    uint32_t received;
+    // File transfers only (path set): the head takes the first data_offset
+    // bytes of the message, and the contents are staged in buffer and
+    // pwritten to fd (-1 if it could not be opened) at buffer_position. The
+    // message's data starts file_position bytes into the file, and more says
+    // the next message of the file follows.
+    char* path;
+    int fd;
+    uint32_t data_offset;
+    uint32_t buffered;
+    uint64_t buffer_position;
+    uint64_t file_position;
+    unsigned char more;
+    long start_usec;
+};
+typedef struct Reassembly_t Reassembly;
+
+// Receive-side state for one sender: its window and the messages being
+// reassembled from it
+struct RecvPeer_t {
+    uint16_t src_id;
+    seq_t LAF;
+    seq_t LFR;
+    // Reassembly entries keyed by msg_id, and a file transfer waiting for
+    // its next message
+    PeerTable messages;
+    Reassembly* file;
+    // Frames buffered ahead of LFR + 1, and how many
+    RecvSlot* recv_ring;
+    uint32_t buffered;
+    // Delayed ACK: in-order frames not acknowledged yet and the last of
+    // them; ack_timer acknowledges them once ack_delay_usec has passed
+    uint32_t unacked;
+    seq_t ack_trigger;
+    TimerEntry ack_timer;
+    // On the receiver's ack_list, to be acknowledged after this batch
+    unsigned char ack_queued;
+    struct RecvPeer_t* ack_next;
+};
+typedef struct RecvPeer_t RecvPeer;
+
+#define CACHE_LINE_SIZE 64
+
+// Protocol counters. Only the owning endpoint writes them, with the relaxed
+// atomics in stats.h; readers (the stats command, SIGUSR1) get a snapshot
+// that may be slightly stale. Each struct is aligned to a cache line, and
+// its size is rounded up to one, so the hot endpoint fields around it never
+// share its lines.
+
+// Frames of ours the link dropped or corrupted, counted in communicate.c
+struct LinkStats_t {
+    atomic_ulong dropped;
+    atomic_ulong corrupted;
+};
+typedef struct LinkStats_t LinkStats;
+
+struct SenderStats_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong frames_sent;
+    // Data frames sent again after a timeout or a fast retransmit (part of
+    // frames_sent)
+    atomic_ulong frames_retransmitted;
+    // Retransmission timers that expired: a frame's with Selective Repeat, a
+    // window's with Go-Back-N
+    atomic_ulong timeouts;
+    atomic_ulong fast_retransmits;
+    // Multiplicative decreases of a congestion window
+    atomic_ulong cwnd_cuts;
+    atomic_ulong acks_received;
+    // ACKs that did not move the window
+    atomic_ulong acks_duplicate;
+    atomic_ulong crc_failures;
+    // Valid frames meant for someone else
+    atomic_ulong frames_ignored;
+    LinkStats link;
+    // Sum of the peer window length right after each first send
+    atomic_ulong window_occupancy_sum;
+    atomic_ulong max_in_flight;
+    // Commands waiting to be framed, and the largest inbox batch
+    atomic_ulong max_buffered;
+    atomic_ulong max_inbox_batch;
+    // RTT samples taken, and the RTO estimate as of the last change (srtt_usec
+    // only once there is a sample)
+    atomic_ulong rtt_samples;
+    atomic_ulong srtt_usec;
+    atomic_ulong rto_usec;
+    // Total time spent holding buffer_mutex in run_sender, and how often
+    atomic_ulong lock_hold_nsec;
+    atomic_ulong lock_holds;
+};
+typedef struct SenderStats_t SenderStats;
+_Static_assert(_Alignof(SenderStats) == CACHE_LINE_SIZE &&
+                   sizeof(SenderStats) % CACHE_LINE_SIZE == 0,
+               "SenderStats must fill whole cache lines");
+
+struct ReceiverStats_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong frames_received;
+    atomic_ulong crc_failures;
+    atomic_ulong frames_ignored;
+    // Already delivered, or already buffered
+    atomic_ulong duplicates;
+    // Buffered ahead of a gap, and dropped beyond the window
+    atomic_ulong out_of_order;
+    atomic_ulong out_of_window;
+    atomic_ulong messages_delivered;
+    atomic_ulong acks_sent;
+    // ACKs sent by the delayed ACK timer (part of acks_sent)
+    atomic_ulong acks_delayed;
+    LinkStats link;
+    atomic_ulong max_inbox_batch;
+    // Total time spent holding buffer_mutex in run_receiver, and how often
+    atomic_ulong lock_hold_nsec;
+    atomic_ulong lock_holds;
+};
+typedef struct ReceiverStats_t ReceiverStats;
+_Static_assert(_Alignof(ReceiverStats) == CACHE_LINE_SIZE &&
+                   sizeof(ReceiverStats) % CACHE_LINE_SIZE == 0,
+               "ReceiverStats must fill whole cache lines");
+
 // Receiver and sender data structures
 struct Receiver_t {
     // DO NOT CHANGE:
@@ -77,12 +408,25 @@ struct Receiver_t {
     pthread_cond_t buffer_cv;
     LLnode* input_framelist_head;
     int recv_id;
-    uint16_t* sender_seq_ids;
+    // Lock-free inbox, used instead of input_framelist_head with -i mpsc
+    MpscQueue frame_inbox;
+    MpscWaker inbox_waker;
+    // Only with -e epoll
+    EventLoop event_loop;
+    // Only with -w
+    Task task;
+    // Set by receiver_request_stop; run_receiver returns once it sees it
+    atomic_int stopping;
+    // Per-sender windows keyed by src_id, allocated on first contact
+    PeerTable peers;
     // Sliding Window Variables
-    uint8_t RWS;
-    uint8_t LAF;
-    uint8_t LFR;
-    char* long_msg;
+    uint32_t RWS;
+    uint32_t recv_mask;
+    // Delayed ACK timers of every peer, and the peers to acknowledge at the
+    // end of the current batch
+    TimerWheel* timer_wheel;
+    RecvPeer* ack_list;
+    _Alignas(CACHE_LINE_SIZE) ReceiverStats stats;
 };
 
 struct Sender_t {
@@ -97,16 +441,46 @@ struct Sender_t {
     LLnode* input_cmdlist_head;
     LLnode* input_framelist_head;
     int send_id;
-    Frame* pending_frame;
-    struct timeval* timeout_timeval;
-    uint8_t seqNum;
+    // Lock-free inboxes, used instead of the lists above with -i mpsc
+    MpscQueue cmd_inbox;
+    MpscQueue frame_inbox;
+    MpscWaker inbox_waker;
+    // Only with -e epoll
+    EventLoop event_loop;
+    // Only with -w
+    Task task;
+    // Set by sender_request_drain: once no input is left and every frame is
+    // acknowledged, count drain_latch down and return from run_sender
+    atomic_int draining;
+    Latch* drain_latch;
+    // msg_id of the next command
     uint16_t packet_id;
-    LLnode* buffer_framelist_head;
+    // Peers with commands waiting, served round-robin, and how many
+    // commands they hold between them
+    SendPeer* ready_head;
+    SendPeer* ready_tail;
+    int pending_cmds;
     // Sliding Window Variables
-    LLnode* window_buffer_head;
-    uint8_t SWS;
-    uint8_t LFS;
-    uint8_t LAR;
+    // Per-receiver windows keyed by dst_id, allocated on first use
+    PeerTable peers;
+    uint32_t window_mask;
+    // Frames in flight across all peers
+    int in_flight;
+    // Retransmission timers: one per in-flight frame (Selective Repeat) or
+    // one per peer (Go-Back-N)
+    TimerWheel* timer_wheel;
+    // Retransmission timeout estimation (Jacobson/Karels); srtt_usec < 0
+    // until the first sample
+    long srtt_usec;
+    long rttvar_usec;
+    long rto_usec;
+    // Smallest RTT sample, -1 until the first: the path without the time
+    // frames wait in the receiver's delayed ACKs, which paces new frames
+    long min_rtt_usec;
+    uint32_t SWS;
+    // Largest congestion window: SWS, and no more than a receiver's window
+    uint32_t max_cwnd;
+    _Alignas(CACHE_LINE_SIZE) SenderStats stats;
 };
 
 enum SendFrame_DstType { ReceiverDst, SenderDst } SendFrame_DstType;
@@ -128,5 +502,8 @@ int glb_senders_array_length;
 int glb_receivers_array_length;
 SysConfig glb_sysconfig;
 int CORRUPTION_BITS;
+// When set, receivers hand each complete message here instead of printing
+// it (proto_bench)
+void (*glb_delivery_hook)(int recv_id, const char* message, uint32_t length);
 
 #endif
@@ -1,37 +1,118 @@
 #include "communicate.h"
+#include "stats.h"
 
 //*********************************************************************
 // NOTE: We will overwrite this file, so whatever changes you put here
 //      WILL NOT persist
 //*********************************************************************
+// Simulated link: the frame shows up in the inbox one link delay later
+static void sim_deliver_frame(void* target, void* value) {
+    mpsc_push(target, value);
+}
+
+// Queue a wire buffer on one endpoint's inbox and wake it up
+static void deliver_frame(char* char_buffer, enum SendFrame_DstType dst_type,
+                          int index) {
+    if (glb_sysconfig.simulate) {
+        MpscQueue* inbox = dst_type == ReceiverDst
+                               ? &glb_receivers_array[index].frame_inbox
+                               : &glb_senders_array[index].frame_inbox;
+        sim_at(sim_now() + SIM_LINK_DELAY_USEC, sim_deliver_frame, inbox,
+               char_buffer);
+        return;
+    }
+
+    if (glb_sysconfig.lockfree_inbox) {
+        if (dst_type == ReceiverDst) {
+            mpsc_push(&glb_receivers_array[index].frame_inbox, char_buffer);
+        } else if (dst_type == SenderDst) {
+            mpsc_push(&glb_senders_array[index].frame_inbox, char_buffer);
+        }
+        return;
+    }
+
+    if (dst_type == ReceiverDst) {
+        Receiver* dst = &glb_receivers_array[index];
+        pthread_mutex_lock(&dst->buffer_mutex);
+        ll_append_node(&dst->input_framelist_head, (void*) char_buffer);
+        pthread_cond_signal(&dst->buffer_cv);
+        pthread_mutex_unlock(&dst->buffer_mutex);
+    } else if (dst_type == SenderDst) {
+        Sender* dst = &glb_senders_array[index];
+        pthread_mutex_lock(&dst->buffer_mutex);
+        ll_append_node(&dst->input_framelist_head, (void*) char_buffer);
+        pthread_cond_signal(&dst->buffer_cv);
+        pthread_mutex_unlock(&dst->buffer_mutex);
+    }
+}
+
+// The endpoint a frame is addressed to: dst_id for data frames, src_id for
+// ACKs heading back to their sender. Read from the header as it was sent,
+// before the link gets a chance to corrupt it.
+static int frame_route(const char* char_buffer, enum SendFrame_DstType dst_type) {
+    uint16_t src_id, dst_id;
+    frame_peek_ids(char_buffer, &src_id, &dst_id);
+    return dst_type == ReceiverDst ? dst_id : src_id;
+}
+
+// The link counters of the endpoint that sent the frame, i.e. the caller:
+// data frames carry their sender in src_id, ACKs their receiver in dst_id
+static LinkStats* link_stats(const char* char_buffer,
+                             enum SendFrame_DstType dst_type) {
+    uint16_t src_id, dst_id;
+    frame_peek_ids(char_buffer, &src_id, &dst_id);
+    uint16_t id = dst_type == ReceiverDst ? src_id : dst_id;
+    if (dst_type == ReceiverDst && id < glb_senders_array_length) {
+        return &glb_senders_array[id].stats.link;
+    }
+    if (dst_type == SenderDst && id < glb_receivers_array_length) {
+        return &glb_receivers_array[id].stats.link;
+    }
+    return NULL;
+}
+
+// Simulation draws from its own seeded PRNG so runs are reproducible
+static int link_rand(void) {
+    return glb_sysconfig.simulate ? sim_rand() : rand();
+}
+
 void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
-    int i = 0, j;
-    char* per_recv_char_buffer;
+    int i = 0;
 
     // Multiply out the probabilities to some degree of precision
     int prob_prec = 1000;
     int drop_prob = (int) prob_prec * glb_sysconfig.drop_prob;
     int corrupt_prob = (int) prob_prec * glb_sysconfig.corrupt_prob;
     int num_corrupt_bits = CORRUPTION_BITS;
-    int corrupt_indices[num_corrupt_bits];
 
     // Pick a random number
-    int random_num = rand() % prob_prec;
+    int random_num = link_rand() % prob_prec;
     int random_index;
 
+    LinkStats* link = link_stats(char_buffer, dst_type);
+
     // Drop the packet on the floor
     if (random_num < drop_prob) {
-        free(char_buffer);
+        if (link != NULL) {
+            stats_inc(&link->dropped);
+        }
+        wire_free(char_buffer);
         return;
     }
 
-    // Determine whether to corrupt bits
-    random_num = rand() % prob_prec;
+    int route = frame_route(char_buffer, dst_type);
+
+    // Determine whether to corrupt bits. Every destination shares the one
+    // buffer, so it is corrupted once, in place.
+    random_num = link_rand() % prob_prec;
     if (random_num < corrupt_prob) {
-        // Pick random indices to corrupt
+        if (link != NULL) {
+            stats_inc(&link->corrupted);
+        }
+        // Corrupt bits at random indices
         for (i = 0; i < num_corrupt_bits; i++) {
-            random_index = rand() % MAX_FRAME_SIZE;
-            corrupt_indices[i] = random_index;
+            random_index = link_rand() % MAX_FRAME_SIZE;
+            char_buffer[random_index] = ~char_buffer[random_index];
         }
     }
 
@@ -43,41 +124,26 @@ void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
         array_length = glb_senders_array_length;
     }
 
-    // Go through the dst array and add the packet to their receive queues
-    for (i = 0; i < array_length; i++) {
-        // Allocate a per receiver char buffer for the message
-        per_recv_char_buffer = (char*) malloc(sizeof(char) * MAX_FRAME_SIZE);
-        memcpy(per_recv_char_buffer, char_buffer, MAX_FRAME_SIZE);
-
-        // Corrupt the bits (inefficient, should just corrupt one copy and
-        // memcpy it
-        if (random_num < corrupt_prob) {
-            // Corrupt bits at the chosen random indices
-            for (j = 0; j < num_corrupt_bits; j++) {
-                random_index = corrupt_indices[j];
-                per_recv_char_buffer[random_index] =
-                    ~per_recv_char_buffer[random_index];
-            }
-        }
-
-        if (dst_type == ReceiverDst) {
-            Receiver* dst = &glb_receivers_array[i];
-            pthread_mutex_lock(&dst->buffer_mutex);
-            ll_append_node(&dst->input_framelist_head,
-                           (void*) per_recv_char_buffer);
-            pthread_cond_signal(&dst->buffer_cv);
-            pthread_mutex_unlock(&dst->buffer_mutex);
-        } else if (dst_type == SenderDst) {
-            Sender* dst = &glb_senders_array[i];
-            pthread_mutex_lock(&dst->buffer_mutex);
-            ll_append_node(&dst->input_framelist_head,
-                           (void*) per_recv_char_buffer);
-            pthread_cond_signal(&dst->buffer_cv);
-            pthread_mutex_unlock(&dst->buffer_mutex);
+    // Unicast: only the addressed endpoint ever sees the frame
+    if (glb_sysconfig.unicast) {
+        if (route < array_length) {
+            deliver_frame(char_buffer, dst_type, route);
+        } else {
+            wire_free(char_buffer);
         }
+        return;
     }
 
-    free(char_buffer);
+    // Broadcast: take a reference per extra destination up front, so an
+    // early consumer can't release the buffer under the others
+    if (array_length == 0) {
+        wire_free(char_buffer);
+        return;
+    }
+    wire_ref(char_buffer, array_length - 1);
+    for (i = 0; i < array_length; i++) {
+        deliver_frame(char_buffer, dst_type, i);
+    }
     return;
 }
 
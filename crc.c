@@ -0,0 +1,297 @@
+// clock_gettime is POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "crc.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC_HAVE_CLMUL 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// Slice-by-8 tables: crc_table[0] is the classic byte table, crc_table[k]
+// advances a byte through k further zero bytes
+static uint32_t crc_table[8][256];
+
+// floor(x^96 / P) without its leading x^64 term, for Barrett reduction
+static uint64_t crc_barrett_mu;
+
+// x^(64 * i) mod P for every 64-bit word position inside a frame
+static uint64_t crc_word_shift[MAX_FRAME_SIZE / 8 + 1];
+
+static int crc_tables_ready = 0;
+
+// crc_init times each kernel over CRC_TIMING_RUNS batches of this many frames
+#define CRC_TIMING_FRAMES 512
+#define CRC_TIMING_RUNS 5
+
+static inline uint32_t load_be32(const unsigned char* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t load_be64(const unsigned char* p) {
+    return ((uint64_t) load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void crc_build_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t) i << 24;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ CRC_POLY : crc << 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t prev = crc_table[k - 1][i];
+            crc_table[k][i] = (prev << 8) ^ crc_table[0][prev >> 24];
+        }
+    }
+
+    // Long division of x^96 by P; the x^64 quotient bit is always set
+    uint64_t poly = (1ULL << 32) | CRC_POLY;
+    uint64_t rem = (1ULL << 32) ^ poly;
+    uint64_t mu = 0;
+    for (int i = 63; i >= 0; i--) {
+        rem <<= 1;
+        if (rem & (1ULL << 32)) {
+            mu |= 1ULL << i;
+            rem ^= poly;
+        }
+    }
+    crc_barrett_mu = mu;
+
+    uint32_t shift = 1;
+    crc_word_shift[0] = shift;
+    for (size_t i = 1; i < sizeof(crc_word_shift) / sizeof(crc_word_shift[0]);
+         i++) {
+        for (int j = 0; j < 64; j++) {
+            shift = (shift & 0x80000000) ? (shift << 1) ^ CRC_POLY : shift << 1;
+        }
+        crc_word_shift[i] = shift;
+    }
+    crc_tables_ready = 1;
+}
+
+// Reference kernel: the original bit-at-a-time division against
+// CRC_GENERATOR, kept so every other kernel can be checked against it
+static uint32_t crc_bitwise(const unsigned char* buf, size_t len) {
+    unsigned char remainder[len + CRC_SIZE];
+    memcpy(remainder, buf, len);
+    memset(remainder + len, 0, CRC_SIZE);
+
+    for (size_t i = 0; i < len; i++) {
+        for (int j = 0; j < 8; j++) {
+            if ((remainder[i] & (0x80 >> j)) == 0) continue;
+            remainder[i] ^= ((CRC_GENERATOR >> (4 * 8 + j)) & 0xFF);
+            remainder[i + 1] ^= ((CRC_GENERATOR >> (3 * 8 + j)) & 0xFF);
+            remainder[i + 2] ^= ((CRC_GENERATOR >> (2 * 8 + j)) & 0xFF);
+            remainder[i + 3] ^= ((CRC_GENERATOR >> (1 * 8 + j)) & 0xFF);
+            remainder[i + 4] ^= ((CRC_GENERATOR >> j) & 0xFF);
+        }
+    }
+    return load_be32(remainder + len);
+}
+
+static uint32_t crc_bytewise_tail(uint32_t crc, const unsigned char* buf,
+                                  size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ buf[i]];
+    }
+    return crc;
+}
+
+static uint32_t crc_slice8(const unsigned char* buf, size_t len) {
+    uint32_t crc = 0;
+    while (len >= 8) {
+        uint32_t hi = crc ^ load_be32(buf);
+        uint32_t lo = load_be32(buf + 4);
+        crc = crc_table[7][hi >> 24] ^ crc_table[6][(hi >> 16) & 0xFF] ^
+              crc_table[5][(hi >> 8) & 0xFF] ^ crc_table[4][hi & 0xFF] ^
+              crc_table[3][lo >> 24] ^ crc_table[2][(lo >> 16) & 0xFF] ^
+              crc_table[1][(lo >> 8) & 0xFF] ^ crc_table[0][lo & 0xFF];
+        buf += 8;
+        len -= 8;
+    }
+    return crc_bytewise_tail(crc, buf, len);
+}
+
+static int crc_always_supported(void) { return 1; }
+
+#ifdef CRC_HAVE_CLMUL
+static int crc_clmul_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+}
+
+// Carry-less 64x64 multiply; returns the high 64 bits and stores the low ones
+__attribute__((target("pclmul"))) static inline uint64_t
+clmul64(uint64_t a, uint64_t b, uint64_t* lo) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long) a),
+                                        _mm_cvtsi64_si128((long long) b), 0x00);
+    *lo = (uint64_t) _mm_cvtsi128_si64(prod);
+    return (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(prod, prod));
+}
+
+// The covered part of a frame is split into 64-bit words c_0..c_{n-1} (the
+// first one zero-extended, since leading zeros do not change the CRC). Each
+// word is multiplied by x^(64 * (n - 1 - i)) mod P independently, the
+// products are xored together, folded back to 64 bits and reduced with two
+// carry-less multiplies (Barrett). Only the last three steps are serial.
+__attribute__((target("pclmul"))) static uint32_t
+crc_clmul(const unsigned char* buf, size_t len) {
+    if (len > MAX_FRAME_SIZE) {
+        return crc_slice8(buf, len);
+    }
+
+    size_t lead = len % 8;
+    size_t words = len / 8 + (lead != 0);
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lo;
+
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        if (i == 0 && lead != 0) {
+            word = 0;
+            for (size_t j = 0; j < lead; j++) {
+                word = (word << 8) | buf[j];
+            }
+            buf += lead;
+        } else {
+            word = load_be64(buf);
+            buf += 8;
+        }
+
+        size_t shift = words - 1 - i;
+        if (shift == 0) {
+            acc = _mm_xor_si128(acc, _mm_cvtsi64_si128((long long) word));
+        } else {
+            acc = _mm_xor_si128(
+                acc, _mm_clmulepi64_si128(
+                         _mm_cvtsi64_si128((long long) word),
+                         _mm_cvtsi64_si128((long long) crc_word_shift[shift]),
+                         0x00));
+        }
+    }
+
+    // acc = hi * x^64 + lo with hi < x^32; fold hi back below x^64
+    uint64_t acc_hi = (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    uint64_t t = (uint64_t) _mm_cvtsi128_si64(acc);
+    clmul64(acc_hi, crc_word_shift[1], &lo);
+    t ^= lo;
+
+    // crc = t * x^32 mod P
+    uint64_t q = t ^ clmul64(t, crc_barrett_mu, &lo);
+    clmul64(q, CRC_POLY, &lo);
+    return (uint32_t) lo;
+}
+#endif
+
+static const CrcKernel crc_kernels[] = {
+    { "bitwise", crc_bitwise, crc_always_supported },
+    { "slice8", crc_slice8, crc_always_supported },
+#ifdef CRC_HAVE_CLMUL
+    { "clmul", crc_clmul, crc_clmul_supported },
+#endif
+};
+static const int crc_kernels_length =
+    sizeof(crc_kernels) / sizeof(crc_kernels[0]);
+
+static const CrcKernel* crc_active = &crc_kernels[1];
+
+const CrcKernel* crc_get_kernels(int* count) {
+    *count = crc_kernels_length;
+    return crc_kernels;
+}
+
+const CrcKernel* crc_get_active_kernel(void) { return crc_active; }
+
+// Compare a kernel with the reference on fixed pseudo-random frames
+int crc_kernel_verify(const CrcKernel* kernel) {
+    unsigned char frame[MAX_FRAME_SIZE];
+    uint32_t state = 0x12345678;
+
+    if (!crc_tables_ready) {
+        crc_build_tables();
+    }
+    if (!kernel->supported()) {
+        return 0;
+    }
+    for (size_t len = 0; len <= CRC_COVERED_SIZE; len++) {
+        for (int i = 0; i < MAX_FRAME_SIZE; i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            frame[i] = (unsigned char) state;
+        }
+        if (kernel->compute(frame, len) != crc_bitwise(frame, len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int crc_select_kernel(const char* name) {
+    for (int i = 0; i < crc_kernels_length; i++) {
+        if (strcmp(crc_kernels[i].name, name) == 0) {
+            if (!crc_kernel_verify(&crc_kernels[i])) {
+                return -1;
+            }
+            crc_active = &crc_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Best of a few short runs over full frames, in nanoseconds per run. The
+// minimum filters out preemption and cold caches.
+static long crc_kernel_time(const CrcKernel* kernel) {
+    unsigned char frame[MAX_FRAME_SIZE];
+    volatile uint32_t sink = 0;
+    long best = -1;
+
+    for (int i = 0; i < MAX_FRAME_SIZE; i++) {
+        frame[i] = (unsigned char) (i * 131 + 7);
+    }
+    for (int run = 0; run < CRC_TIMING_RUNS; run++) {
+        struct timespec start, finish;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < CRC_TIMING_FRAMES; i++) {
+            frame[0] = (unsigned char) i;
+            sink += kernel->compute(frame, CRC_COVERED_SIZE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        long nsec = (finish.tv_sec - start.tv_sec) * 1000000000L +
+                    (finish.tv_nsec - start.tv_nsec);
+        if (best < 0 || nsec < best) {
+            best = nsec;
+        }
+    }
+    (void) sink;
+    return best;
+}
+
+// The bitwise reference is never timed: it is far slower than any table or
+// carry-less kernel and only stays active if none of them verifies
+void crc_init(void) {
+    long best = -1;
+
+    crc_build_tables();
+    crc_active = &crc_kernels[0];
+    for (int i = 1; i < crc_kernels_length; i++) {
+        if (!crc_kernel_verify(&crc_kernels[i])) {
+            continue;
+        }
+        long nsec = crc_kernel_time(&crc_kernels[i]);
+        if (best < 0 || nsec < best) {
+            best = nsec;
+            crc_active = &crc_kernels[i];
+        }
+    }
+}
+
+uint32_t crc_compute(const unsigned char* buf, size_t len) {
+    return crc_active->compute(buf, len);
+}
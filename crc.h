@@ -0,0 +1,39 @@
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include "common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The generator in common.h is the 33-bit CRC-32 polynomial shifted up by 7
+// so the bitwise division could line it up with a byte. Every kernel below
+// computes the same remainder: MSB-first, zero initial value, no final xor.
+#define CRC_POLY ((uint32_t) (CRC_GENERATOR >> 7))
+
+// Number of leading frame bytes covered by the CRC
+#define CRC_COVERED_SIZE (MAX_FRAME_SIZE - CRC_SIZE)
+
+typedef uint32_t (*crc_kernel_fn)(const unsigned char*, size_t);
+
+// A CRC kernel and whether the running CPU can execute it
+struct CrcKernel_t {
+    const char* name;
+    crc_kernel_fn compute;
+    int (*supported)(void);
+};
+typedef struct CrcKernel_t CrcKernel;
+
+// Build the lookup tables, verify every kernel the CPU supports against the
+// bitwise reference, time the ones that passed and select the fastest
+void crc_init(void);
+
+// Kernel registry, the bitwise reference first
+const CrcKernel* crc_get_kernels(int* count);
+const CrcKernel* crc_get_active_kernel(void);
+int crc_select_kernel(const char* name);
+int crc_kernel_verify(const CrcKernel* kernel);
+
+// Remainder of buf using the active kernel
+uint32_t crc_compute(const unsigned char* buf, size_t len);
+
+#endif
@@ -0,0 +1,66 @@
+#include "common.h"
+#include "crc.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define BENCH_FRAMES 256
+#define DEFAULT_BENCH_ROUNDS 20000
+
+// Microbenchmark for the CRC kernels: encodes the same batch of frames with
+// every kernel the CPU supports and reports frames/sec for each
+int main(int argc, char* argv[]) {
+    static char frames[BENCH_FRAMES][MAX_FRAME_SIZE];
+    int rounds = DEFAULT_BENCH_ROUNDS;
+    int kernels_length;
+    const CrcKernel* kernels;
+
+    if (argc > 1) {
+        sscanf(argv[1], "%d", &rounds);
+    }
+
+    crc_init();
+    kernels = crc_get_kernels(&kernels_length);
+
+    srand(1);
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        for (int j = 0; j < CRC_COVERED_SIZE; j++) {
+            frames[i][j] = (char) rand();
+        }
+    }
+
+    printf("active kernel: %s\n", crc_get_active_kernel()->name);
+    for (int k = 0; k < kernels_length; k++) {
+        const CrcKernel* kernel = &kernels[k];
+        struct timeval start_time, finish_time;
+        uint32_t checksum = 0;
+
+        if (!crc_kernel_verify(kernel)) {
+            printf("%-8s unsupported or mismatched, skipped\n", kernel->name);
+            continue;
+        }
+
+        // The reference kernel is orders of magnitude slower; keep it short
+        int kernel_rounds = strcmp(kernel->name, "bitwise") == 0 ? rounds / 100 + 1
+                                                                 : rounds;
+
+        gettimeofday(&start_time, NULL);
+        for (int r = 0; r < kernel_rounds; r++) {
+            for (int i = 0; i < BENCH_FRAMES; i++) {
+                checksum += kernel->compute((unsigned char*) frames[i],
+                                            CRC_COVERED_SIZE);
+            }
+        }
+        gettimeofday(&finish_time, NULL);
+
+        long usec = timeval_usecdiff(&start_time, &finish_time);
+        double frames_done = (double) kernel_rounds * BENCH_FRAMES;
+        printf("%-8s %12.0f frames/sec  (%.1f ns/frame, checksum %08x)\n",
+               kernel->name, frames_done * 1e6 / (usec > 0 ? usec : 1),
+               usec * 1e3 / frames_done, checksum);
+    }
+    return 0;
+}
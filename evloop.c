@@ -0,0 +1,87 @@
+// CLOCK_MONOTONIC is POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "evloop.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+void event_loop_init(EventLoop* loop, MpscWaker* waker) {
+    struct epoll_event event;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(loop->epoll_fd >= 0);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert(loop->timer_fd >= 0);
+    loop->armed_deadline = -1;
+
+    event.events = EPOLLIN;
+    event.data.fd = waker->event_fd;
+    int rc = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, waker->event_fd, &event);
+    assert(rc == 0);
+    event.events = EPOLLIN;
+    event.data.fd = loop->timer_fd;
+    rc = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event);
+    assert(rc == 0);
+    (void) rc;
+}
+
+void event_loop_destroy(EventLoop* loop) {
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+}
+
+// Only touch the timerfd when the deadline actually moved; re-arming also
+// clears any expiration that has not been read
+static void event_loop_arm(EventLoop* loop, long deadline_usec) {
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+
+    if (deadline_usec == loop->armed_deadline) {
+        return;
+    }
+    if (deadline_usec >= 0) {
+        spec.it_value.tv_sec = deadline_usec / 1000000;
+        spec.it_value.tv_nsec = deadline_usec % 1000000 * 1000;
+        // An all-zero it_value would disarm instead
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    loop->armed_deadline = deadline_usec;
+}
+
+void event_loop_wait(EventLoop* loop, MpscWaker* waker, MpscQueue** queues,
+                     int queues_length, long deadline_usec) {
+    struct epoll_event events[2];
+    uint64_t count;
+
+    if (deadline_usec >= 0 && deadline_usec <= current_time_usec()) {
+        return;
+    }
+    event_loop_arm(loop, deadline_usec);
+
+    // Same handshake as mpsc_waker_wait: announce the sleep, then look once
+    // more so a concurrent push either shows up here or writes the eventfd
+    atomic_store(&waker->parked, 1);
+    for (int i = 0; i < queues_length; i++) {
+        if (!mpsc_is_empty(queues[i])) {
+            atomic_store(&waker->parked, 0);
+            return;
+        }
+    }
+
+    int ready = epoll_wait(loop->epoll_fd, events, 2, -1);
+    for (int i = 0; i < ready; i++) {
+        ssize_t drained = read(events[i].data.fd, &count, sizeof(count));
+        (void) drained;
+        if (events[i].data.fd == loop->timer_fd) {
+            loop->armed_deadline = -1;
+        }
+    }
+    atomic_store(&waker->parked, 0);
+}
@@ -0,0 +1,26 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include "mpsc.h"
+
+// epoll-based wait for one endpoint (-e epoll): the inbox waker's eventfd and
+// a CLOCK_MONOTONIC timerfd for the next retransmission deadline. With no
+// deadline the endpoint sleeps until something is pushed, so an idle
+// endpoint never wakes up.
+struct EventLoop_t {
+    int epoll_fd;
+    int timer_fd;
+    // Deadline the timerfd is armed for (monotonic usec), -1 when disarmed
+    long armed_deadline;
+};
+typedef struct EventLoop_t EventLoop;
+
+void event_loop_init(EventLoop*, MpscWaker*);
+void event_loop_destroy(EventLoop*);
+
+// Consumer only: sleep until one of the queues gets a value, the waker is
+// woken, or the monotonic deadline (usec, -1 for none) passes
+void event_loop_wait(EventLoop*, MpscWaker*, MpscQueue** queues,
+                     int queues_length, long deadline_usec);
+
+#endif
@@ -0,0 +1,126 @@
+#include "common.h"
+#include "mpsc.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define DEFAULT_BENCH_ITEMS 200000
+#define MAX_BENCH_PRODUCERS 16
+
+// Contention benchmark for the endpoint inboxes: P producer threads fan into
+// one consumer, once through the mutex + condvar list that send_frame uses by
+// default and once through the lock-free MPSC queue (-i mpsc)
+struct BenchInbox_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    LLnode* head;
+    MpscWaker waker;
+    MpscQueue queue;
+    int lockfree;
+    int items_per_producer;
+};
+typedef struct BenchInbox_t BenchInbox;
+
+static void* run_producer(void* arg) {
+    BenchInbox* inbox = arg;
+    for (int i = 0; i < inbox->items_per_producer; i++) {
+        void* value = (void*) (long) (i + 1);
+        if (inbox->lockfree) {
+            mpsc_push(&inbox->queue, value);
+        } else {
+            pthread_mutex_lock(&inbox->mutex);
+            ll_append_node(&inbox->head, value);
+            pthread_cond_signal(&inbox->cv);
+            pthread_mutex_unlock(&inbox->mutex);
+        }
+    }
+    return NULL;
+}
+
+// Deadline far enough out that only a push wakes the consumer
+static void bench_deadline(struct timespec* deadline) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    deadline->tv_sec = now.tv_sec + 1;
+    deadline->tv_nsec = now.tv_usec * 1000;
+}
+
+static long consume(BenchInbox* inbox, long expected) {
+    long consumed = 0;
+    struct timespec deadline;
+    MpscQueue* queues[] = { &inbox->queue };
+
+    while (consumed < expected) {
+        bench_deadline(&deadline);
+        if (inbox->lockfree) {
+            if (mpsc_pop(&inbox->queue) != NULL) {
+                consumed++;
+                continue;
+            }
+            mpsc_waker_wait(&inbox->waker, queues, 1, &deadline);
+        } else {
+            pthread_mutex_lock(&inbox->mutex);
+            if (inbox->head == NULL) {
+                pthread_cond_timedwait(&inbox->cv, &inbox->mutex, &deadline);
+            }
+            LLnode* head = ll_splice(&inbox->head);
+            pthread_mutex_unlock(&inbox->mutex);
+
+            LLnode* node;
+            while ((node = ll_pop_node(&head)) != NULL) {
+                ll_free_node(node);
+                consumed++;
+            }
+        }
+    }
+    return consumed;
+}
+
+static void run_bench(int lockfree, int producers, int items) {
+    BenchInbox inbox;
+    pthread_t threads[MAX_BENCH_PRODUCERS];
+    struct timeval start_time, finish_time;
+
+    pthread_mutex_init(&inbox.mutex, NULL);
+    pthread_cond_init(&inbox.cv, NULL);
+    inbox.head = NULL;
+    mpsc_waker_init(&inbox.waker);
+    mpsc_init(&inbox.queue, &inbox.waker);
+    inbox.lockfree = lockfree;
+    inbox.items_per_producer = items;
+
+    gettimeofday(&start_time, NULL);
+    for (int p = 0; p < producers; p++) {
+        pthread_create(&threads[p], NULL, run_producer, &inbox);
+    }
+    long consumed = consume(&inbox, (long) producers * items);
+    for (int p = 0; p < producers; p++) {
+        pthread_join(threads[p], NULL);
+    }
+    gettimeofday(&finish_time, NULL);
+
+    long usec = timeval_usecdiff(&start_time, &finish_time);
+    printf("%-6s %2d producers %12.0f items/sec  (%.1f ns/item)\n",
+           lockfree ? "mpsc" : "mutex", producers,
+           consumed * 1e6 / (usec > 0 ? usec : 1), usec * 1e3 / consumed);
+
+    mpsc_waker_destroy(&inbox.waker);
+    pthread_mutex_destroy(&inbox.mutex);
+    pthread_cond_destroy(&inbox.cv);
+}
+
+int main(int argc, char* argv[]) {
+    int items = DEFAULT_BENCH_ITEMS;
+
+    if (argc > 1) {
+        sscanf(argv[1], "%d", &items);
+    }
+
+    for (int producers = 1; producers <= MAX_BENCH_PRODUCERS; producers *= 2) {
+        run_bench(0, producers, items);
+        run_bench(1, producers, items);
+    }
+    return 0;
+}
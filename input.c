@@ -1,4 +1,6 @@
 #include "input.h"
+#include "replay.h"
+#include "stats.h"
 
 #include <assert.h>
 
@@ -93,8 +95,10 @@ void* run_stdinthread(void* threadid) {
     char input_command[MAX_COMMAND_LENGTH];
     Sender* sender;
 
-    // Unused
-    (void) threadid;
+    // -a replays a script instead of reading stdin
+    if (glb_sysconfig.automated) {
+        return run_replay(threadid);
+    }
 
     // Zero out fd_sets
     FD_ZERO(&read_fds);
@@ -126,6 +130,12 @@ void* run_stdinthread(void* threadid) {
             input_bytes_read =
                 getline(&input_buffer, &input_buffer_size, stdin);
 
+            // End of input behaves like the exit command
+            if (input_bytes_read < 0) {
+                free(input_buffer);
+                return 0;
+            }
+
             // Zero out the readin buffers for the command
             memset(input_command, 0, MAX_COMMAND_LENGTH * sizeof(char));
 
@@ -144,11 +154,15 @@ void* run_stdinthread(void* threadid) {
                     free(input_message);
                     free(input_buffer);
                     return 0;
+                } else if (strcmp(input_command, "stats") == 0) {
+                    stats_print(stderr);
                 } else {
                     fprintf(stderr, "Command is ill-formatted\n");
                 }
             } else {
-                if (strcmp(input_command, "msg") == 0) {
+                int is_msg = strcmp(input_command, "msg") == 0;
+                int is_file = strcmp(input_command, "file") == 0;
+                if (is_msg || is_file) {
                     // Check to ensure that the sender and receiver ids are in
                     // the right range
                     if (sender_id >= glb_senders_array_length ||
@@ -159,35 +173,55 @@ void* run_stdinthread(void* threadid) {
                         receiver_id < 0) {
                         fprintf(stderr, "Receiver id is invalid\n");
                     }
+                    size_t message_length = strlen(input_message);
+                    if (is_msg && message_length > MAX_MESSAGE_SIZE) {
+                        fprintf(stderr, "Message is too long\n");
+                    }
 
                     // Only add if valid
+                    Cmd* outgoing_cmd = NULL;
                     if (sender_id < glb_senders_array_length &&
                         receiver_id < glb_receivers_array_length &&
-                        sender_id >= 0 && receiver_id >= 0) {
-                        // Add the message to the receive buffer for the
-                        // appropriate thread
-                        Cmd* outgoing_cmd = malloc(sizeof(Cmd));
-                        char* outgoing_msg =
-                            malloc(sizeof(char) * (strlen(input_message) + 1));
+                        sender_id >= 0 && receiver_id >= 0 &&
+                        (is_file || message_length <= MAX_MESSAGE_SIZE)) {
+                        outgoing_cmd = calloc(1, sizeof(Cmd));
+                        assert(outgoing_cmd);
+                        outgoing_cmd->src_id = sender_id;
+                        outgoing_cmd->dst_id = receiver_id;
+                    }
 
+                    if (outgoing_cmd != NULL && is_file) {
+                        // The sender frames the mapped file as its window
+                        // opens up
+                        if (cmd_map_file(outgoing_cmd, input_message) < 0) {
+                            free(outgoing_cmd);
+                            outgoing_cmd = NULL;
+                        }
+                    } else if (outgoing_cmd != NULL) {
                         // Copy out the input message into the outgoing command
                         // object
+                        char* outgoing_msg =
+                            malloc(sizeof(char) * (message_length + 1));
                         strcpy(outgoing_msg, input_message);
-
-                        outgoing_cmd->src_id = sender_id;
-                        outgoing_cmd->dst_id = receiver_id;
                         outgoing_cmd->message = outgoing_msg;
+                        outgoing_cmd->length = message_length;
+                    }
 
-                        // Add it to the appropriate input buffer
+                    // Add it to the appropriate input buffer
+                    if (outgoing_cmd != NULL) {
                         sender = &glb_senders_array[sender_id];
 
-                        // Lock the buffer, add to the input list, and signal
-                        // the thread
-                        pthread_mutex_lock(&sender->buffer_mutex);
-                        ll_append_node(&sender->input_cmdlist_head,
-                                       outgoing_cmd);
-                        pthread_cond_signal(&sender->buffer_cv);
-                        pthread_mutex_unlock(&sender->buffer_mutex);
+                        if (glb_sysconfig.lockfree_inbox) {
+                            mpsc_push(&sender->cmd_inbox, outgoing_cmd);
+                        } else {
+                            // Lock the buffer, add to the input list, and
+                            // signal the thread
+                            pthread_mutex_lock(&sender->buffer_mutex);
+                            ll_append_node(&sender->input_cmdlist_head,
+                                           outgoing_cmd);
+                            pthread_cond_signal(&sender->buffer_cv);
+                            pthread_mutex_unlock(&sender->buffer_mutex);
+                        }
                     }
                 } else {
                     fprintf(stderr, "Unknown command:%s\n", input_buffer);
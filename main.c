@@ -2,7 +2,9 @@
 #include "communicate.h"
 #include "input.h"
 #include "receiver.h"
+#include "replay.h"
 #include "sender.h"
+#include "stats.h"
 #include "util.h"
 
 #include <assert.h>
@@ -18,6 +20,34 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+// Defaults for the options added to glb_sysconfig since the original ones
+static void init_config_defaults(void) {
+    glb_sysconfig.arq_mode = arq_go_back_n;
+    glb_sysconfig.congestion_control = cc_fixed;
+    glb_sysconfig.send_window_size = DEFAULT_WINDOW_SIZE;
+    glb_sysconfig.recv_window_size = DEFAULT_WINDOW_SIZE;
+    glb_sysconfig.unicast = 0;
+    glb_sysconfig.lockfree_inbox = 0;
+    glb_sysconfig.epoll_backend = 0;
+    glb_sysconfig.worker_pool = 0;
+    glb_sysconfig.pool_workers = 0;
+    glb_sysconfig.simulate = 0;
+    glb_sysconfig.seed = 1;
+    glb_sysconfig.wire_format = wire_plain;
+    glb_sysconfig.ack_every = DEFAULT_ACK_EVERY;
+    glb_sysconfig.ack_delay_usec = DEFAULT_ACK_DELAY_USEC;
+    glb_sysconfig.output_dir = NULL;
+}
+
+// malloc only promises 16-byte alignment, and the endpoint stats need cache
+// lines of their own
+static void* realloc_cache_aligned(void* array, size_t size) {
+    free(array);
+    array = aligned_alloc(CACHE_LINE_SIZE, size);
+    assert(array);
+    return array;
+}
+
 int main(int argc, char* argv[]) {
     pthread_t stdin_thread;
     pthread_t* sender_threads;
@@ -42,6 +72,11 @@ int main(int argc, char* argv[]) {
     glb_senders_array_length = -1;
     srand(time(NULL));
 
+    init_config_defaults();
+
+    // Pick the fastest CRC kernel this CPU supports
+    crc_init();
+
     // Parse out the command line arguments
     for (i = 1; i < argc;) {
         if (strcmp(argv[i], "-s") == 0) {
@@ -65,6 +100,79 @@ int main(int argc, char* argv[]) {
                 strcpy(glb_sysconfig.automated_file, argv[i + 1]);
             }
             i += 2;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            if (strcmp(argv[i + 1], "sr") == 0) {
+                glb_sysconfig.arq_mode = arq_selective_repeat;
+            } else if (strcmp(argv[i + 1], "gbn") == 0) {
+                glb_sysconfig.arq_mode = arq_go_back_n;
+            } else {
+                print_usage = 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-cc") == 0) {
+            if (strcmp(argv[i + 1], "aimd") == 0) {
+                glb_sysconfig.congestion_control = cc_aimd;
+            } else if (strcmp(argv[i + 1], "fixed") == 0) {
+                glb_sysconfig.congestion_control = cc_fixed;
+            } else {
+                print_usage = 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-sws") == 0) {
+            sscanf(argv[i + 1], "%d", &glb_sysconfig.send_window_size);
+            i += 2;
+        } else if (strcmp(argv[i], "-rws") == 0) {
+            sscanf(argv[i + 1], "%d", &glb_sysconfig.recv_window_size);
+            i += 2;
+        } else if (strcmp(argv[i], "-ackn") == 0) {
+            sscanf(argv[i + 1], "%d", &glb_sysconfig.ack_every);
+            i += 2;
+        } else if (strcmp(argv[i], "-ackt") == 0) {
+            sscanf(argv[i + 1], "%ld", &glb_sysconfig.ack_delay_usec);
+            i += 2;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            if (strcmp(argv[i + 1], "mpsc") == 0) {
+                glb_sysconfig.lockfree_inbox = 1;
+            } else if (strcmp(argv[i + 1], "mutex") == 0) {
+                glb_sysconfig.lockfree_inbox = 0;
+            } else {
+                print_usage = 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            if (strcmp(argv[i + 1], "epoll") == 0) {
+                glb_sysconfig.epoll_backend = 1;
+            } else if (strcmp(argv[i + 1], "cond") == 0) {
+                glb_sysconfig.epoll_backend = 0;
+            } else {
+                print_usage = 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            glb_sysconfig.worker_pool = 1;
+            sscanf(argv[i + 1], "%d", &glb_sysconfig.pool_workers);
+            i += 2;
+        } else if (strcmp(argv[i], "--simulate") == 0) {
+            glb_sysconfig.simulate = 1;
+            i++;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            sscanf(argv[i + 1], "%lu", &glb_sysconfig.seed);
+            i += 2;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            if (strcmp(argv[i + 1], "packed") == 0) {
+                glb_sysconfig.wire_format = wire_packed;
+            } else if (strcmp(argv[i + 1], "plain") == 0) {
+                glb_sysconfig.wire_format = wire_plain;
+            } else {
+                print_usage = 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            glb_sysconfig.output_dir = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            glb_sysconfig.unicast = 1;
+            i++;
         } else if (strcmp(argv[i], "-h") == 0) {
             print_usage = 1;
             i++;
@@ -73,17 +181,52 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // The epoll backend waits on the lock-free inboxes' eventfd. Pool tasks
+    // are woken by pushes to those inboxes and never wait on their own.
+    if (glb_sysconfig.epoll_backend) {
+        glb_sysconfig.lockfree_inbox = 1;
+    }
+    if (glb_sysconfig.worker_pool || glb_sysconfig.simulate) {
+        glb_sysconfig.lockfree_inbox = 1;
+        glb_sysconfig.epoll_backend = 0;
+    }
+    // Simulation runs every endpoint on the main thread
+    if (glb_sysconfig.simulate) {
+        glb_sysconfig.worker_pool = 0;
+        sim_init(glb_sysconfig.seed);
+    }
+    int own_threads = !glb_sysconfig.worker_pool && !glb_sysconfig.simulate;
+
     // Spot check the input variables
     if (glb_senders_array_length <= 0 || glb_receivers_array_length <= 0 ||
         (glb_sysconfig.drop_prob < 0 || glb_sysconfig.drop_prob > 1) ||
         (glb_sysconfig.corrupt_prob < 0 || glb_sysconfig.corrupt_prob > 1) ||
-        print_usage) {
+        glb_sysconfig.send_window_size < 1 || glb_sysconfig.recv_window_size < 1 ||
+        glb_sysconfig.send_window_size + glb_sysconfig.recv_window_size > SEQ_SPACE / 2 ||
+        glb_sysconfig.ack_every < 1 || glb_sysconfig.ack_delay_usec < 0 ||
+        glb_sysconfig.pool_workers < 0 || print_usage) {
         fprintf(
             stderr,
             "USAGE: %s \n   -r int [# of receivers] \n   -s int [# of senders] "
             "\n   -c float [0 <= corruption prob <= 1] \n   -d float [0 <= "
-            "drop prob <= 1]\n",
-            argv[0]);
+            "drop prob <= 1]\n   -p gbn|sr [Go-Back-N (default) or Selective "
+            "Repeat]\n   -sws int -rws int [sender/receiver window sizes, "
+            "sws + rws <= %ld]\n   -cc fixed|aimd [always sws (default) or "
+            "a congestion window up to min(sws, rws)]\n   -ackn int -ackt "
+            "int [ACK every n in-order frames or after t usec, default %d "
+            "and %d; -ackn 1 ACKs every frame]\n   -u [deliver frames to "
+            "the addressed endpoint only]\n   -f plain|packed [fixed (default) or "
+            "variable-length frame headers]\n   -i mutex|mpsc "
+            "[mutex-protected (default) or lock-free inboxes]\n"
+            "   -e cond|epoll [timed condvar waits "
+            "(default) or epoll on eventfd + timerfd, implies -i mpsc]\n"
+            "   -w int [run endpoints on a pool of this many worker threads, "
+            "0 = one per CPU; implies -i mpsc]\n   --simulate [single-threaded "
+            "discrete-event run on a virtual clock]\n   --seed int [link "
+            "PRNG seed for --simulate, default 1]\n   -a file [replay a "
+            "command script instead of reading stdin]\n   -o dir [create "
+            "received files in dir, default the current directory]\n",
+            argv[0], SEQ_SPACE / 2, DEFAULT_ACK_EVERY, DEFAULT_ACK_DELAY_USEC);
         exit(1);
     }
 
@@ -100,6 +243,11 @@ int main(int argc, char* argv[]) {
     glb_receivers_array = malloc(glb_receivers_array_length * sizeof(Receiver));
     assert(glb_receivers_array);
 
+    glb_senders_array = realloc_cache_aligned(
+        glb_senders_array, glb_senders_array_length * sizeof(Sender));
+    glb_receivers_array = realloc_cache_aligned(
+        glb_receivers_array, glb_receivers_array_length * sizeof(Receiver));
+
     fprintf(stderr, "Messages will be dropped with probability=%f\n",
             glb_sysconfig.drop_prob);
     fprintf(stderr, "Messages will be corrupted with probability=%f\n",
@@ -123,6 +271,22 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "   recv_id=%d\n", i);
     }
 
+    // kill -USR1 prints the counters so far; before any thread exists, so
+    // they all inherit the blocked signal
+    stats_start_signal_thread();
+
+    if (glb_sysconfig.worker_pool) {
+        worker_pool_start(glb_sysconfig.pool_workers);
+        fprintf(stderr, "Running endpoints on %d worker thread(s)\n",
+                worker_pool_get_workers());
+    }
+
+    // Commands come from stdin, or from the -a script (run_stdinthread
+    // hands over to run_replay). Simulation: commands enter at virtual time 0
+    // (a script's pacing plays the transfer out as far as each wait) while
+    // this thread waits to join the input thread, and sim_run below plays out
+    // the rest.
+
     // DO NOT CHANGE THIS
     // Create the standard input thread
     int rc = pthread_create(&stdin_thread, NULL, run_stdinthread, (void*) 0);
@@ -131,8 +295,8 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    // Spawn sender threads
-    for (i = 0; i < glb_senders_array_length; i++) {
+    // Spawn sender threads; pool tasks need no thread of their own
+    for (i = 0; own_threads && i < glb_senders_array_length; i++) {
         rc = pthread_create(sender_threads + i, NULL, run_sender,
                             (void*) &glb_senders_array[i]);
         if (rc) {
@@ -143,7 +307,7 @@ int main(int argc, char* argv[]) {
     }
 
     // Spawn receiver threads
-    for (i = 0; i < glb_receivers_array_length; i++) {
+    for (i = 0; own_threads && i < glb_receivers_array_length; i++) {
         rc = pthread_create(receiver_threads + i, NULL, run_receiver,
                             (void*) &glb_receivers_array[i]);
         if (rc) {
@@ -154,30 +318,55 @@ int main(int argc, char* argv[]) {
     }
     pthread_join(stdin_thread, NULL);
 
-    // Wait for senders to be completely finished (no pending ACK, no msgs to send, no cmds to process)
+    // No more commands can arrive: ask every sender to drain and block until
+    // the last one has had its final frame acknowledged
+    Latch senders_drained;
+    latch_init(&senders_drained, glb_senders_array_length);
     for (i = 0; i < glb_senders_array_length; i++) {
-        while ((&glb_senders_array[i])->pending_frame != NULL || (&glb_senders_array[i])->buffer_framelist_head != NULL || (&glb_senders_array[i])->input_cmdlist_head != NULL) {
-            // Idle
-        }
+        sender_request_drain(&glb_senders_array[i], &senders_drained);
+    }
+    if (glb_sysconfig.simulate) {
+        unsigned long events = sim_run();
+        fprintf(stderr, "Simulated %ld.%06lds of virtual time in %lu events\n",
+                sim_now() / 1000000, sim_now() % 1000000, events);
     }
+    latch_wait(&senders_drained);
+    latch_destroy(&senders_drained);
 
-    for (i = 0; i < glb_senders_array_length; i++) {
-        pthread_cancel(sender_threads[i]);
+    for (i = 0; own_threads && i < glb_senders_array_length; i++) {
         pthread_join(sender_threads[i], NULL);
     }
 
+    // Receivers have delivered everything that was acknowledged
     for (i = 0; i < glb_receivers_array_length; i++) {
-        pthread_cancel(receiver_threads[i]);
+        receiver_request_stop(&glb_receivers_array[i]);
+    }
+    for (i = 0; own_threads && i < glb_receivers_array_length; i++) {
         pthread_join(receiver_threads[i], NULL);
     }
+    if (glb_sysconfig.worker_pool) {
+        worker_pool_stop();
+    }
+
+    stats_print(stderr);
+
+    // Frames, wire buffers and list nodes all come from the slab pools, so
+    // this count stays flat once they have warmed up
+    fprintf(stderr, "Slab pool mallocs: %lu\n", pool_get_slab_mallocs());
 
     free(sender_threads);
     free(receiver_threads);
+    for (i = 0; i < glb_senders_array_length; i++) {
+        destroy_sender(&glb_senders_array[i]);
+    }
     free(glb_senders_array);
     for (i = 0; i < glb_receivers_array_length; i++) {
-        free((&glb_receivers_array[i])->sender_seq_ids);
+        destroy_receiver(&glb_receivers_array[i]);
     }
     free(glb_receivers_array);
+    if (glb_sysconfig.simulate) {
+        sim_destroy();
+    }
 
     return 0;
 }
@@ -0,0 +1,173 @@
+#include "mpsc.h"
+#include "pool.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+void mpsc_waker_init(MpscWaker* waker) {
+    atomic_init(&waker->parked, 0);
+    waker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(waker->event_fd >= 0);
+    waker->notify = NULL;
+    waker->notify_arg = NULL;
+}
+
+void mpsc_waker_destroy(MpscWaker* waker) {
+    if (waker->event_fd >= 0) {
+        close(waker->event_fd);
+    }
+}
+
+void mpsc_waker_wake(MpscWaker* waker) {
+    uint64_t one = 1;
+    if (waker->notify != NULL) {
+        waker->notify(waker->notify_arg);
+        return;
+    }
+    ssize_t written = write(waker->event_fd, &one, sizeof(one));
+    (void) written;
+}
+
+void mpsc_init(MpscQueue* queue, MpscWaker* waker) {
+    atomic_init(&queue->stub.next, NULL);
+    queue->stub.value = NULL;
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+    queue->waker = waker;
+}
+
+// Append the nodes first .. last, already linked and with last->next NULL
+static void mpsc_push_nodes(MpscQueue* queue, MpscNode* first, MpscNode* last) {
+    MpscNode* prev = atomic_exchange(&queue->head, last);
+    // Between the exchange and this store the queue is briefly unlinked;
+    // mpsc_pop sees that as empty and the wakeup below covers it
+    atomic_store_explicit(&prev->next, first, memory_order_release);
+}
+
+static void mpsc_push_node(MpscQueue* queue, MpscNode* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_push_nodes(queue, node, node);
+}
+
+// Wake the consumer after a push
+static void mpsc_pushed(MpscQueue* queue) {
+    // Pool tasks track their own state; notify is cheap when they are busy
+    if (queue->waker->notify != NULL) {
+        queue->waker->notify(queue->waker->notify_arg);
+        return;
+    }
+
+    // Only pay for the syscall when the consumer is (about to be) asleep
+    if (atomic_exchange(&queue->waker->parked, 0)) {
+        uint64_t one = 1;
+        ssize_t written = write(queue->waker->event_fd, &one, sizeof(one));
+        (void) written;
+    }
+}
+
+void mpsc_push(MpscQueue* queue, void* value) {
+    MpscNode* node = pool_alloc(&mpsc_node_pool);
+    node->value = value;
+    mpsc_push_node(queue, node);
+    mpsc_pushed(queue);
+}
+
+void mpsc_push_batch(MpscQueue* queue, void** values, int values_length) {
+    if (values_length == 0) {
+        return;
+    }
+
+    // Link the chain privately; it only becomes visible with the exchange
+    MpscNode* first = pool_alloc(&mpsc_node_pool);
+    MpscNode* last = first;
+    first->value = values[0];
+    for (int i = 1; i < values_length; i++) {
+        MpscNode* node = pool_alloc(&mpsc_node_pool);
+        node->value = values[i];
+        atomic_store_explicit(&last->next, node, memory_order_relaxed);
+        last = node;
+    }
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+    mpsc_push_nodes(queue, first, last);
+    mpsc_pushed(queue);
+}
+
+// Unlink the oldest node, or return NULL
+static MpscNode* mpsc_pop_node(MpscQueue* queue) {
+    MpscNode* tail = queue->tail;
+    MpscNode* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // tail is the last linked node; if a push is in progress, wait for it
+    if (tail != atomic_load(&queue->head)) {
+        return NULL;
+    }
+
+    // Put the stub back behind tail so tail can be handed out
+    mpsc_push_node(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void* mpsc_pop(MpscQueue* queue) {
+    MpscNode* node = mpsc_pop_node(queue);
+    if (node == NULL) {
+        return NULL;
+    }
+    void* value = node->value;
+    pool_free(&mpsc_node_pool, node);
+    return value;
+}
+
+int mpsc_is_empty(MpscQueue* queue) {
+    return queue->tail == &queue->stub &&
+           atomic_load(&queue->head) == &queue->stub;
+}
+
+void mpsc_waker_wait(MpscWaker* waker, MpscQueue** queues, int queues_length,
+                     const struct timespec* deadline) {
+    // Announce the sleep before the final emptiness check: a producer either
+    // sees parked == 1 and writes the eventfd, or we see its value here
+    atomic_store(&waker->parked, 1);
+    for (int i = 0; i < queues_length; i++) {
+        if (!mpsc_is_empty(queues[i])) {
+            atomic_store(&waker->parked, 0);
+            return;
+        }
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long wait_usec = (deadline->tv_sec - now.tv_sec) * 1000000L +
+                     (deadline->tv_nsec / 1000 - now.tv_usec);
+    if (wait_usec > 0) {
+        // Round up so we never wake just short of the deadline
+        struct pollfd poll_fd = { waker->event_fd, POLLIN, 0 };
+        poll(&poll_fd, 1, (int) ((wait_usec + 999) / 1000));
+    }
+
+    uint64_t count;
+    ssize_t drained = read(waker->event_fd, &count, sizeof(count));
+    (void) drained;
+    atomic_store(&waker->parked, 0);
+}
@@ -0,0 +1,68 @@
+#ifndef __MPSC_H__
+#define __MPSC_H__
+
+#include <stdatomic.h>
+#include <time.h>
+
+// Lock-free multi-producer/single-consumer queue (Vyukov's intrusive node
+// queue): a push is one atomic exchange, so producers never wait on each
+// other or on the consumer. Nodes come from a slab pool; values are opaque.
+struct MpscNode_t {
+    _Atomic(struct MpscNode_t*) next;
+    void* value;
+};
+typedef struct MpscNode_t MpscNode;
+
+// Parks one consumer on an eventfd. Producers only write to it when the
+// consumer has announced it is about to sleep, so a busy consumer costs
+// them nothing beyond the push.
+struct MpscWaker_t {
+    atomic_int parked;
+    int event_fd;
+    // When set (worker pool tasks), called on every push and wake instead of
+    // the parked handshake; event_fd is then -1
+    void (*notify)(void* arg);
+    void* notify_arg;
+};
+typedef struct MpscWaker_t MpscWaker;
+
+struct MpscQueue_t {
+    _Atomic(MpscNode*) head;
+    // Consumer only
+    MpscNode* tail;
+    MpscNode stub;
+    MpscWaker* waker;
+};
+typedef struct MpscQueue_t MpscQueue;
+
+void mpsc_waker_init(MpscWaker*);
+void mpsc_waker_destroy(MpscWaker*);
+
+// Wake the consumer even though nothing was pushed, e.g. to shut it down;
+// unlike a push this always costs a write
+void mpsc_waker_wake(MpscWaker*);
+
+// Queues sharing a waker wake the same consumer
+void mpsc_init(MpscQueue*, MpscWaker*);
+
+// Any thread
+void mpsc_push(MpscQueue*, void* value);
+
+// Any thread: push values in order with a single exchange and at most one
+// wakeup; another producer's values never land in between
+void mpsc_push_batch(MpscQueue*, void** values, int values_length);
+
+// Consumer only: the oldest value, or NULL when the queue is empty (or a
+// producer is half-way through a push; its wakeup follows)
+void* mpsc_pop(MpscQueue*);
+
+// Exact on the consumer thread, a hint anywhere else
+int mpsc_is_empty(MpscQueue*);
+
+// Consumer only: sleep until something is pushed onto one of the queues or
+// the absolute CLOCK_REALTIME deadline passes. Returns at once if any of the
+// queues already holds a value.
+void mpsc_waker_wait(MpscWaker*, MpscQueue** queues, int queues_length,
+                     const struct timespec* deadline);
+
+#endif
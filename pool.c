@@ -0,0 +1,140 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+SlabPool frame_pool = { "frame", sizeof(Frame), 0, PTHREAD_MUTEX_INITIALIZER,
+                        NULL, 0, 0 };
+SlabPool wire_pool = { "wire", sizeof(WireBuf), 1, PTHREAD_MUTEX_INITIALIZER,
+                       NULL, 0, 0 };
+SlabPool node_pool = { "node", sizeof(LLnode), 2, PTHREAD_MUTEX_INITIALIZER,
+                       NULL, 0, 0 };
+SlabPool mpsc_node_pool = { "mpsc_node", sizeof(MpscNode), 3,
+                            PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static SlabPool* all_pools[] = { &frame_pool, &wire_pool, &node_pool,
+                                 &mpsc_node_pool };
+
+struct PoolCache_t {
+    PoolObject* head;
+    size_t length;
+};
+typedef struct PoolCache_t PoolCache;
+
+static _Thread_local PoolCache pool_caches[POOL_MAX_POOLS];
+
+static size_t pool_stride(SlabPool* pool) {
+    size_t align = sizeof(max_align_t);
+    size_t size = pool->obj_size < sizeof(PoolObject) ? sizeof(PoolObject)
+                                                      : pool->obj_size;
+    return (size + align - 1) / align * align;
+}
+
+// Move up to one batch from the depot into the cache, carving a fresh slab
+// when the depot is empty
+static void pool_refill(SlabPool* pool, PoolCache* cache) {
+    pthread_mutex_lock(&pool->depot_mutex);
+    if (pool->depot == NULL) {
+        size_t stride = pool_stride(pool);
+        char* slab = malloc(stride * POOL_SLAB_OBJECTS);
+        assert(slab);
+        pool->slab_mallocs++;
+        for (int i = 0; i < POOL_SLAB_OBJECTS; i++) {
+            PoolObject* obj = (PoolObject*) (slab + i * stride);
+            obj->next = pool->depot;
+            pool->depot = obj;
+        }
+        pool->depot_length += POOL_SLAB_OBJECTS;
+    }
+
+    for (int i = 0; i < POOL_BATCH && pool->depot != NULL; i++) {
+        PoolObject* obj = pool->depot;
+        pool->depot = obj->next;
+        pool->depot_length--;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->length++;
+    }
+    pthread_mutex_unlock(&pool->depot_mutex);
+}
+
+static void pool_drain(SlabPool* pool, PoolCache* cache) {
+    PoolObject* first = cache->head;
+    PoolObject* last = first;
+    for (int i = 1; i < POOL_BATCH; i++) {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->length -= POOL_BATCH;
+
+    pthread_mutex_lock(&pool->depot_mutex);
+    last->next = pool->depot;
+    pool->depot = first;
+    pool->depot_length += POOL_BATCH;
+    pthread_mutex_unlock(&pool->depot_mutex);
+}
+
+void* pool_alloc(SlabPool* pool) {
+    PoolCache* cache = &pool_caches[pool->id];
+    if (cache->head == NULL) {
+        pool_refill(pool, cache);
+    }
+    PoolObject* obj = cache->head;
+    cache->head = obj->next;
+    cache->length--;
+    return obj;
+}
+
+void pool_free(SlabPool* pool, void* ptr) {
+    PoolCache* cache = &pool_caches[pool->id];
+    PoolObject* obj = (PoolObject*) ptr;
+    if (ptr == NULL) {
+        return;
+    }
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->length++;
+    if (cache->length > POOL_CACHE_LIMIT) {
+        pool_drain(pool, cache);
+    }
+}
+
+unsigned long pool_get_slab_mallocs(void) {
+    unsigned long total = 0;
+    for (size_t i = 0; i < sizeof(all_pools) / sizeof(all_pools[0]); i++) {
+        pthread_mutex_lock(&all_pools[i]->depot_mutex);
+        total += all_pools[i]->slab_mallocs;
+        pthread_mutex_unlock(&all_pools[i]->depot_mutex);
+    }
+    return total;
+}
+
+Frame* frame_alloc(void) {
+    Frame* frame = pool_alloc(&frame_pool);
+    memset(frame, 0, sizeof(Frame));
+    return frame;
+}
+
+void frame_free(Frame* frame) { pool_free(&frame_pool, frame); }
+
+char* wire_alloc(void) {
+    WireBuf* wire = pool_alloc(&wire_pool);
+    atomic_init(&wire->refcount, 1);
+    return wire->data;
+}
+
+void wire_ref(char* char_buf, int count) {
+    WireBuf* wire = container_of(char_buf, WireBuf, data);
+    atomic_fetch_add_explicit(&wire->refcount, count, memory_order_relaxed);
+}
+
+void wire_free(char* char_buf) {
+    if (char_buf == NULL) {
+        return;
+    }
+    WireBuf* wire = container_of(char_buf, WireBuf, data);
+    if (atomic_fetch_sub_explicit(&wire->refcount, 1, memory_order_acq_rel) == 1) {
+        pool_free(&wire_pool, wire);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "common.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Objects carved out of one malloc'd slab
+#define POOL_SLAB_OBJECTS 64
+// Objects moved between a thread cache and the shared depot at once
+#define POOL_BATCH 32
+// A thread cache holding more than this hands a batch back to the depot
+#define POOL_CACHE_LIMIT (4 * POOL_BATCH)
+#define POOL_MAX_POOLS 4
+
+struct PoolObject_t {
+    struct PoolObject_t* next;
+};
+typedef struct PoolObject_t PoolObject;
+
+// Fixed-size object pool. Each thread allocates from and frees into its own
+// cache without locking; caches only touch the depot (under depot_mutex) to
+// trade whole batches, so objects freed by a different thread than the one
+// that allocated them flow back without ever reaching malloc/free.
+struct SlabPool_t {
+    const char* name;
+    size_t obj_size;
+    int id;
+    pthread_mutex_t depot_mutex;
+    PoolObject* depot;
+    size_t depot_length;
+    unsigned long slab_mallocs;
+};
+typedef struct SlabPool_t SlabPool;
+
+// A wire buffer: the frame bytes handed around as char*, preceded by a
+// reference count so one broadcast buffer can sit in several inboxes at once
+struct WireBuf_t {
+    atomic_int refcount;
+    _Alignas(16) char data[MAX_FRAME_SIZE];
+};
+typedef struct WireBuf_t WireBuf;
+
+extern SlabPool frame_pool;
+extern SlabPool wire_pool;
+extern SlabPool node_pool;
+extern SlabPool mpsc_node_pool;
+
+void* pool_alloc(SlabPool*);
+void pool_free(SlabPool*, void*);
+
+// Number of times any pool had to call malloc; constant in steady state
+unsigned long pool_get_slab_mallocs(void);
+
+// Frames and 64-byte wire buffers. wire_alloc hands out one reference,
+// wire_ref adds more and wire_free returns the buffer on the last release.
+Frame* frame_alloc(void);
+void frame_free(Frame*);
+char* wire_alloc(void);
+void wire_ref(char*, int);
+void wire_free(char*);
+
+#endif
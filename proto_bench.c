@@ -0,0 +1,393 @@
+#include "common.h"
+#include "receiver.h"
+#include "sender.h"
+#include "stats.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MAX_GRID_VALUES 16
+#define DEFAULT_BENCH_MESSAGES 2000
+#define DEFAULT_BENCH_INTERVAL_USEC 500
+// Messages start with their index, so they can be matched on delivery
+#define MESSAGE_ID_DIGITS 8
+
+// Protocol benchmark: plays a grid of configurations through the
+// deterministic simulator (--simulate) and prints one row per run. Every
+// sender offers a message every interval_usec of virtual time, round-robin
+// over the receivers; latency runs from that moment to delivery. Because the
+// clock is virtual, the numbers measure the protocol, not the host, and the
+// same seed always gives the same rows. wall_ms is the host cost of the run.
+// -cc fixed,aimd runs every point under both windows, e.g.
+//   proto_bench -cc fixed,aimd -s 1,3 -b 1024 -d 0,0.1 -c 0 -w 16,200
+// where AIMD matches the fixed window's goodput without loss, where it only
+// slow starts, and stays close with it: random loss on a path that is not
+// queueing does not cut the window.
+struct BenchGrid_t {
+    int values_length;
+    double values[MAX_GRID_VALUES];
+};
+typedef struct BenchGrid_t BenchGrid;
+
+struct BenchRun_t {
+    enum ArqMode arq_mode;
+    enum WireFormat wire_format;
+    enum CongestionControl congestion_control;
+    int senders;
+    int receivers;
+    int msg_size;
+    double drop_prob;
+    double corrupt_prob;
+    int window_size;
+};
+typedef struct BenchRun_t BenchRun;
+
+// State for the run in progress, filled by the delivery hook
+static long* sent_usec;
+static long* latency_usec;
+static int delivered;
+static int messages;
+
+static void record_delivery(int recv_id, const char* message, uint32_t length) {
+    int digits = length < MESSAGE_ID_DIGITS ? (int) length : MESSAGE_ID_DIGITS;
+    int id = 0;
+    (void) recv_id;
+
+    for (int i = 0; i < digits && message[i] >= '0' && message[i] <= '9'; i++) {
+        id = id * 10 + message[i] - '0';
+    }
+    if (id < messages && delivered < messages) {
+        latency_usec[delivered++] = sim_now() - sent_usec[id];
+    }
+}
+
+static void inject_cmd(void* target, void* value) {
+    Sender* sender = target;
+    mpsc_push(&sender->cmd_inbox, value);
+}
+
+static int compare_long(const void* a, const void* b) {
+    long x = *(const long*) a;
+    long y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted latencies
+static long percentile(double q) {
+    if (delivered == 0) {
+        return -1;
+    }
+    int rank = (int) (q * delivered + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return latency_usec[rank - 1];
+}
+
+static void run_one(BenchRun* run, long interval_usec, unsigned long seed,
+                    int json, int first) {
+    struct timeval start_time, finish_time;
+    int i;
+
+    glb_sysconfig.arq_mode = run->arq_mode;
+    glb_sysconfig.wire_format = run->wire_format;
+    glb_sysconfig.congestion_control = run->congestion_control;
+    glb_sysconfig.drop_prob = run->drop_prob;
+    glb_sysconfig.corrupt_prob = run->corrupt_prob;
+    glb_sysconfig.send_window_size = run->window_size;
+    glb_sysconfig.recv_window_size = run->window_size;
+    glb_senders_array_length = run->senders;
+    glb_receivers_array_length = run->receivers;
+
+    sim_init(seed);
+    glb_senders_array = aligned_alloc(CACHE_LINE_SIZE, run->senders * sizeof(Sender));
+    glb_receivers_array =
+        aligned_alloc(CACHE_LINE_SIZE, run->receivers * sizeof(Receiver));
+    assert(glb_senders_array && glb_receivers_array);
+    for (i = 0; i < run->senders; i++) {
+        init_sender(&glb_senders_array[i], i);
+    }
+    for (i = 0; i < run->receivers; i++) {
+        init_receiver(&glb_receivers_array[i], i);
+    }
+
+    delivered = 0;
+    for (i = 0; i < messages; i++) {
+        Cmd* cmd = calloc(1, sizeof(Cmd));
+        assert(cmd);
+        cmd->src_id = i % run->senders;
+        cmd->dst_id = i / run->senders % run->receivers;
+        cmd->message = malloc(run->msg_size + 1);
+        assert(cmd->message);
+        memset(cmd->message, 'x', run->msg_size);
+        cmd->message[run->msg_size] = '\0';
+        cmd->length = run->msg_size;
+        char id[16];
+        snprintf(id, sizeof(id), "%0*d", MESSAGE_ID_DIGITS, i);
+        memcpy(cmd->message, id, MESSAGE_ID_DIGITS);
+
+        sent_usec[i] = (long) (i / run->senders) * interval_usec;
+        sim_at(sent_usec[i], inject_cmd, &glb_senders_array[cmd->src_id], cmd);
+    }
+
+    // Once no event is left, everything has been delivered and acknowledged
+    gettimeofday(&start_time, NULL);
+    unsigned long events = sim_run();
+    gettimeofday(&finish_time, NULL);
+    (void) events;
+
+    unsigned long frames_sent = 0;
+    unsigned long frames_retransmitted = 0;
+    for (i = 0; i < run->senders; i++) {
+        frames_sent += stats_read(&glb_senders_array[i].stats.frames_sent);
+        frames_retransmitted +=
+            stats_read(&glb_senders_array[i].stats.frames_retransmitted);
+    }
+    unsigned long acks_sent = 0;
+    for (i = 0; i < run->receivers; i++) {
+        acks_sent += stats_read(&glb_receivers_array[i].stats.acks_sent);
+    }
+    qsort(latency_usec, delivered, sizeof(long), compare_long);
+
+    long virtual_usec = sim_now();
+    double goodput = virtual_usec > 0
+                         ? (double) delivered * run->msg_size * 1000000.0 / virtual_usec
+                         : 0;
+    double retx_ratio = frames_sent > 0
+                            ? (double) frames_retransmitted / frames_sent
+                            : 0;
+    const char* arq = run->arq_mode == arq_selective_repeat ? "sr" : "gbn";
+    const char* format = run->wire_format == wire_packed ? "packed" : "plain";
+    const char* cc = run->congestion_control == cc_aimd ? "aimd" : "fixed";
+    long wall_usec = timeval_usecdiff(&start_time, &finish_time);
+
+    if (json) {
+        printf("%s  {\"arq\": \"%s\", \"format\": \"%s\", \"cc\": \"%s\", "
+               "\"senders\": %d, "
+               "\"receivers\": %d, \"msg_size\": %d, \"drop\": %.3f, \"corrupt\": %.3f, "
+               "\"window\": %d, \"messages\": %d, \"delivered\": %d, "
+               "\"virtual_ms\": %.3f, \"wall_ms\": %.3f, "
+               "\"goodput_Bps\": %.1f, \"frames_sent\": %lu, "
+               "\"retransmits\": %lu, \"retx_ratio\": %.4f, \"acks\": %lu, "
+               "\"p50_us\": %ld, \"p99_us\": %ld, \"p999_us\": %ld}",
+               first ? "" : ",\n", arq, format, cc, run->senders,
+               run->receivers, run->msg_size, run->drop_prob, run->corrupt_prob,
+               run->window_size, messages, delivered, virtual_usec / 1000.0,
+               wall_usec / 1000.0, goodput, frames_sent, frames_retransmitted,
+               retx_ratio, acks_sent, percentile(0.5), percentile(0.99),
+               percentile(0.999));
+    } else {
+        printf("%s,%s,%s,%d,%d,%d,%.3f,%.3f,%d,%d,%d,%.3f,%.3f,%.1f,%lu,%lu,"
+               "%.4f,%lu,%ld,%ld,%ld\n",
+               arq, format, cc, run->senders, run->receivers, run->msg_size,
+               run->drop_prob, run->corrupt_prob, run->window_size, messages,
+               delivered, virtual_usec / 1000.0, wall_usec / 1000.0, goodput,
+               frames_sent, frames_retransmitted, retx_ratio, acks_sent,
+               percentile(0.5), percentile(0.99), percentile(0.999));
+    }
+    fflush(stdout);
+
+    for (i = 0; i < run->senders; i++) {
+        destroy_sender(&glb_senders_array[i]);
+    }
+    for (i = 0; i < run->receivers; i++) {
+        destroy_receiver(&glb_receivers_array[i]);
+    }
+    free(glb_senders_array);
+    free(glb_receivers_array);
+    sim_destroy();
+}
+
+// Comma-separated list, e.g. "0,0.1,0.3"
+static int parse_grid(const char* arg, BenchGrid* grid) {
+    const char* cursor = arg;
+    grid->values_length = 0;
+
+    while (*cursor != '\0' && grid->values_length < MAX_GRID_VALUES) {
+        char* end;
+        grid->values[grid->values_length++] = strtod(cursor, &end);
+        if (end == cursor) {
+            return 0;
+        }
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return grid->values_length > 0;
+}
+
+static int parse_arq(const char* arg, int* modes) {
+    modes[0] = strstr(arg, "gbn") != NULL;
+    modes[1] = strstr(arg, "sr") != NULL;
+    return modes[0] || modes[1];
+}
+
+static int parse_cc(const char* arg, int* controls) {
+    controls[cc_fixed] = strstr(arg, "fixed") != NULL;
+    controls[cc_aimd] = strstr(arg, "aimd") != NULL;
+    return controls[cc_fixed] || controls[cc_aimd];
+}
+
+static int parse_format(const char* arg, int* formats) {
+    formats[wire_plain] = strstr(arg, "plain") != NULL;
+    formats[wire_packed] = strstr(arg, "packed") != NULL;
+    return formats[wire_plain] || formats[wire_packed];
+}
+
+int main(int argc, char* argv[]) {
+    BenchGrid senders = { 2, { 1, 4 } };
+    BenchGrid receivers = { 1, { 1 } };
+    // One frame, and a message reassembled from seven
+    BenchGrid sizes = { 2, { 16, 256 } };
+    BenchGrid drops = { 3, { 0, 0.1, 0.3 } };
+    BenchGrid corrupts = { 2, { 0, 0.1 } };
+    BenchGrid windows = { 2, { 4, 16 } };
+    int arq_modes[2] = { 1, 1 };
+    int wire_formats[2] = { 1, 0 };
+    int congestion_controls[2] = { 1, 0 };
+    long interval_usec = DEFAULT_BENCH_INTERVAL_USEC;
+    unsigned long seed = 1;
+    int json = 0;
+    int ok = 1;
+
+    messages = DEFAULT_BENCH_MESSAGES;
+    glb_sysconfig.lockfree_inbox = 1;
+    glb_sysconfig.simulate = 1;
+    glb_sysconfig.ack_every = DEFAULT_ACK_EVERY;
+    glb_sysconfig.ack_delay_usec = DEFAULT_ACK_DELAY_USEC;
+    glb_delivery_hook = record_delivery;
+    CORRUPTION_BITS = (int) MAX_FRAME_SIZE / 2;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : "";
+        if (strcmp(argv[i], "-s") == 0) {
+            ok = ok && parse_grid(value, &senders);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            ok = ok && parse_grid(value, &receivers);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            ok = ok && parse_grid(value, &sizes);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            ok = ok && parse_grid(value, &drops);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            ok = ok && parse_grid(value, &corrupts);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            ok = ok && parse_grid(value, &windows);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            ok = ok && parse_arq(value, arq_modes);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            ok = ok && parse_format(value, wire_formats);
+        } else if (strcmp(argv[i], "-cc") == 0) {
+            ok = ok && parse_cc(value, congestion_controls);
+        } else if (strcmp(argv[i], "-ackn") == 0) {
+            ok = ok && sscanf(value, "%d", &glb_sysconfig.ack_every) == 1 &&
+                 glb_sysconfig.ack_every >= 1;
+        } else if (strcmp(argv[i], "-ackt") == 0) {
+            ok = ok && sscanf(value, "%ld", &glb_sysconfig.ack_delay_usec) == 1 &&
+                 glb_sysconfig.ack_delay_usec >= 0;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            ok = ok && sscanf(value, "%d", &messages) == 1 && messages > 0;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            ok = ok && sscanf(value, "%ld", &interval_usec) == 1 && interval_usec >= 0;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            ok = ok && sscanf(value, "%lu", &seed) == 1;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            json = strcmp(value, "json") == 0;
+            ok = ok && (json || strcmp(value, "csv") == 0);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            glb_sysconfig.unicast = 1;
+            continue;
+        } else {
+            ok = 0;
+        }
+        i++;
+    }
+
+    for (int i = 0; i < senders.values_length; i++) {
+        ok = ok && senders.values[i] >= 1 && senders.values[i] <= UINT16_MAX;
+    }
+    for (int i = 0; i < receivers.values_length; i++) {
+        ok = ok && receivers.values[i] >= 1 && receivers.values[i] <= UINT16_MAX;
+    }
+    // A link that drops everything would never finish a run
+    for (int i = 0; i < drops.values_length; i++) {
+        ok = ok && drops.values[i] >= 0 && drops.values[i] < 1;
+    }
+    for (int i = 0; i < corrupts.values_length; i++) {
+        ok = ok && corrupts.values[i] >= 0 && corrupts.values[i] < 1;
+    }
+    for (int i = 0; i < windows.values_length; i++) {
+        ok = ok && windows.values[i] >= 1 && 2 * windows.values[i] <= SEQ_SPACE / 2;
+    }
+    for (int i = 0; i < sizes.values_length; i++) {
+        ok = ok && sizes.values[i] >= MESSAGE_ID_DIGITS &&
+             sizes.values[i] <= MAX_MESSAGE_SIZE;
+    }
+    if (!ok) {
+        fprintf(stderr,
+                "USAGE: %s [-s list] [-r list] [-b sizes] [-d list] [-c list] "
+                "[-w windows] [-p gbn,sr] [-f plain,packed] [-cc fixed,aimd] "
+                "[-ackn n] [-ackt usec] [-m messages] [-i interval_usec] "
+                "[-u] [--seed n] [-o csv|json]\n"
+                "   lists are comma-separated; %d <= size <= %u, drop and "
+                "corrupt < 1\n",
+                argv[0], MESSAGE_ID_DIGITS, MAX_MESSAGE_SIZE);
+        return 1;
+    }
+
+    crc_init();
+    sent_usec = malloc(messages * sizeof(long));
+    latency_usec = malloc(messages * sizeof(long));
+    assert(sent_usec && latency_usec);
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("arq,format,cc,senders,receivers,msg_size,drop,corrupt,window,"
+               "messages,delivered,virtual_ms,wall_ms,goodput_Bps,frames_sent,"
+               "retransmits,retx_ratio,acks,p50_us,p99_us,p999_us\n");
+    }
+
+    // Walk the grid like an odometer, last axis fastest
+    BenchGrid* axes[] = { &senders, &receivers, &sizes, &drops, &corrupts, &windows };
+    const int axes_length = sizeof(axes) / sizeof(axes[0]);
+    int first = 1;
+    for (int f = 0; f < 2; f++) {
+        for (int a = 0; a < 2; a++) {
+            for (int c = 0; c < 2; c++) {
+                int index[sizeof(axes) / sizeof(axes[0])] = { 0 };
+                int done =
+                    !wire_formats[f] || !arq_modes[a] || !congestion_controls[c];
+
+                while (!done) {
+                    BenchRun run = { a ? arq_selective_repeat : arq_go_back_n,
+                                     f ? wire_packed : wire_plain,
+                                     c ? cc_aimd : cc_fixed,
+                                     (int) senders.values[index[0]],
+                                     (int) receivers.values[index[1]],
+                                     (int) sizes.values[index[2]],
+                                     drops.values[index[3]],
+                                     corrupts.values[index[4]],
+                                     (int) windows.values[index[5]] };
+                    run_one(&run, interval_usec, seed, json, first);
+                    first = 0;
+
+                    int axis = axes_length - 1;
+                    while (axis >= 0 &&
+                           ++index[axis] == axes[axis]->values_length) {
+                        index[axis--] = 0;
+                    }
+                    done = axis < 0;
+                }
+            }
+        }
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+
+    free(sent_usec);
+    free(latency_usec);
+    return 0;
+}
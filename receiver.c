@@ -1,95 +1,522 @@
-#include "receiver.h"
+// flockfile and pwrite are POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
 
-#define WINDOW_SIZE 1;
+#include "receiver.h"
+#include "stats.h"
 
-static const MAX_SEQ = 255;
+#include <assert.h>
+#include <fcntl.h>
 
 void init_receiver(Receiver* receiver, int id) {
     pthread_cond_init(&receiver->buffer_cv, NULL);
     pthread_mutex_init(&receiver->buffer_mutex, NULL);
     receiver->recv_id = id;
     receiver->input_framelist_head = NULL;
+    if (glb_sysconfig.worker_pool || glb_sysconfig.simulate) {
+        task_init(&receiver->task, &receiver->inbox_waker, run_receiver_task);
+    } else {
+        mpsc_waker_init(&receiver->inbox_waker);
+    }
+    mpsc_init(&receiver->frame_inbox, &receiver->inbox_waker);
+    if (glb_sysconfig.epoll_backend) {
+        event_loop_init(&receiver->event_loop, &receiver->inbox_waker);
+    }
+    atomic_init(&receiver->stopping, 0);
+
+    // Track a window for each sender
+    receiver->RWS = glb_sysconfig.recv_window_size;
+    peer_table_init(&receiver->peers);
+
+    // Frames that arrive ahead of LFR + 1 wait in a power-of-two ring
+    uint32_t recv_capacity = 1;
+    while (recv_capacity < receiver->RWS) {
+        recv_capacity <<= 1;
+    }
+    receiver->recv_mask = recv_capacity - 1;
+
+    receiver->timer_wheel = malloc(sizeof(TimerWheel));
+    assert(receiver->timer_wheel);
+    timer_wheel_init(receiver->timer_wheel, current_time_usec());
+    receiver->ack_list = NULL;
+
+    memset(&receiver->stats, 0, sizeof(ReceiverStats));
+}
+
+static void free_reassembly(void* value) {
+    Reassembly* message = value;
+    if (message->fd >= 0) {
+        close(message->fd);
+    }
+    free(message->path);
+    free(message->buffer);
+    free(message);
+}
+
+static void free_recv_peer(void* value) {
+    RecvPeer* peer = value;
+    peer_table_destroy(&peer->messages, free_reassembly);
+    if (peer->file != NULL) {
+        free_reassembly(peer->file);
+    }
+    free(peer->recv_ring);
+    free(peer);
+}
+
+void destroy_receiver(Receiver* receiver) {
+    LLnode* ll_node;
+    char* raw_char_buf;
+
+    // Duplicates still in flight when we stopped
+    while ((ll_node = ll_pop_node(&receiver->input_framelist_head)) != NULL) {
+        wire_free(ll_node->value);
+        ll_free_node(ll_node);
+    }
+    while ((raw_char_buf = mpsc_pop(&receiver->frame_inbox)) != NULL) {
+        wire_free(raw_char_buf);
+    }
+
+    peer_table_destroy(&receiver->peers, free_recv_peer);
+    free(receiver->timer_wheel);
+    if (glb_sysconfig.epoll_backend) {
+        event_loop_destroy(&receiver->event_loop);
+    }
+    mpsc_waker_destroy(&receiver->inbox_waker);
+}
+
+void receiver_request_stop(Receiver* receiver) {
+    atomic_store(&receiver->stopping, 1);
+
+    if (glb_sysconfig.lockfree_inbox) {
+        mpsc_waker_wake(&receiver->inbox_waker);
+    } else {
+        pthread_mutex_lock(&receiver->buffer_mutex);
+        pthread_cond_signal(&receiver->buffer_cv);
+        pthread_mutex_unlock(&receiver->buffer_mutex);
+    }
+}
+
+// Window state for one sender, created when its first frame arrives
+static RecvPeer* receiver_peer(Receiver* receiver, uint16_t src_id) {
+    RecvPeer* peer = peer_table_get(&receiver->peers, src_id);
+    if (peer == NULL) {
+        peer = calloc(1, sizeof(RecvPeer));
+        assert(peer);
+        peer->src_id = src_id;
+        peer->LFR = MAX_SEQ;
+        peer->LAF = peer->LFR + receiver->RWS;
+        peer->recv_ring = calloc(receiver->recv_mask + 1, sizeof(RecvSlot));
+        assert(peer->recv_ring);
+        peer_table_init(&peer->messages);
+        peer_table_put(&receiver->peers, src_id, peer);
+    }
+    return peer;
+}
+
+// message may hold any bytes, NULs included
+static void output_message(Receiver* receiver, const char* message,
+                           uint32_t length) {
+    stats_inc(&receiver->stats.messages_delivered);
+    if (glb_delivery_hook != NULL) {
+        glb_delivery_hook(receiver->recv_id, message, length);
+    } else {
+        // One line, even with other receivers printing
+        flockfile(stdout);
+        printf("<RECV_%d>:[", receiver->recv_id);
+        fwrite(message, 1, length, stdout);
+        printf("]\n");
+        funlockfile(stdout);
+    }
+}
 
-    // Track sequences for each sender
-    receiver->sender_seq_ids = calloc(glb_senders_array_length, sizeof(uint16_t));
+// Write out what a file transfer has staged. A failed write closes the file
+// and the rest of the transfer is dropped.
+static void file_flush(Reassembly* message) {
+    uint32_t written = 0;
+    while (message->fd >= 0 && written < message->buffered) {
+        ssize_t result = pwrite(message->fd, message->buffer + written,
+                                message->buffered - written,
+                                (off_t) message->buffer_position + written);
+        if (result < 0) {
+            perror(message->path);
+            close(message->fd);
+            message->fd = -1;
+        } else {
+            written += result;
+        }
+    }
+    message->buffer_position += message->buffered;
+    message->buffered = 0;
+}
+
+// The first fragment of each message of a file transfer holds its head:
+// the file's base name and NUL, then whether more messages follow. The first
+// message creates recv<recv_id>_<name> in the output directory, never over
+// an existing file; the rest have an empty name and pick up where the last
+// left off.
+static Reassembly* file_open(Receiver* receiver, RecvPeer* peer,
+                             Frame* inframe, uint32_t fragment) {
+    const char* name = inframe->data;
+    const char* name_end = memchr(name, '\0', fragment);
+    if (inframe->offset != 0 || name_end == NULL ||
+        name_end + 1 == name + fragment ||
+        memchr(name, '/', name_end - name) != NULL) {
+        return NULL;
+    }
+
+    Reassembly* message = peer->file;
+    peer->file = NULL;
+    if (name_end == name) {
+        if (message == NULL) {
+            return NULL;
+        }
+    } else {
+        // The rest of an earlier transfer never came
+        if (message != NULL) {
+            free_reassembly(message);
+        }
+        const char* dir = glb_sysconfig.output_dir;
+        message = calloc(1, sizeof(Reassembly));
+        assert(message);
+        message->path = malloc((dir != NULL ? strlen(dir) : 0) +
+                               (name_end - name) + 32);
+        assert(message->path);
+        if (dir != NULL) {
+            sprintf(message->path, "%s/recv%d_%s", dir, receiver->recv_id,
+                    name);
+        } else {
+            sprintf(message->path, "recv%d_%s", receiver->recv_id, name);
+        }
+        message->fd =
+            open(message->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (message->fd < 0) {
+            perror(message->path);
+        }
+        message->buffer = malloc(FILE_WRITE_BUFFER_SIZE);
+        assert(message->buffer);
+        message->start_usec = current_time_usec();
+    }
+    message->length = inframe->msg_len;
+    message->received = 0;
+    message->data_offset = name_end - name + 2;
+    message->more = name_end[1];
+    return message;
+}
 
-    receiver->RWS = WINDOW_SIZE;
-    receiver->LAF = WINDOW_SIZE - 1;
-    receiver->LFR = MAX_SEQ;
-    receiver->long_msg = NULL;
+// Stage the file contents in a fragment; in-order delivery makes them
+// contiguous, so the buffer only goes out when full
+static void file_write(Reassembly* message, Frame* inframe, uint32_t fragment) {
+    const char* data = inframe->data;
+    uint32_t offset = inframe->offset;
+    if (offset < message->data_offset) {
+        uint32_t head_bytes = message->data_offset - offset;
+        if (head_bytes > fragment) {
+            head_bytes = fragment;
+        }
+        data += head_bytes;
+        offset += head_bytes;
+        fragment -= head_bytes;
+    }
+
+    uint64_t position =
+        message->file_position + (offset - message->data_offset);
+    if (message->buffer_position + message->buffered != position ||
+        message->buffered + fragment > FILE_WRITE_BUFFER_SIZE) {
+        file_flush(message);
+        message->buffer_position = position;
+    }
+    memcpy(message->buffer + message->buffered, data, fragment);
+    message->buffered += fragment;
 }
 
-void handle_incoming_msgs(Receiver* receiver,
-                          LLnode** outgoing_frames_head_ptr) {
+// Report a finished file transfer, with its sustained rate
+static void file_close(Receiver* receiver, Reassembly* message) {
+    char report[256];
+    int report_length;
+
+    file_flush(message);
+    unsigned long long bytes = message->file_position;
+    long elapsed_usec = current_time_usec() - message->start_usec;
+    if (message->fd < 0) {
+        report_length = snprintf(report, sizeof(report),
+                                 "file %s: not written", message->path);
+    } else {
+        report_length = snprintf(
+            report, sizeof(report), "file %s: %llu bytes, %.2f MB/s",
+            message->path, bytes,
+            elapsed_usec > 0 ? (double) bytes / elapsed_usec : 0.0);
+    }
+    if (report_length >= (int) sizeof(report)) {
+        report_length = sizeof(report) - 1;
+    }
+    output_message(receiver, report, report_length);
+}
+
+// Print a single-frame message straight from the frame; otherwise copy the
+// fragment to its offset (or stage it for the file) and finish the message
+// once every byte is in
+static void deliver_frame(Receiver* receiver, RecvPeer* peer, Frame* inframe) {
+    int file = inframe->flags == 'f';
+    Reassembly* message = peer_table_get(&peer->messages, inframe->msg_id);
+    // Only the first fragment is sure to carry msg_len
+    if (message == NULL && inframe->offset != 0) {
+        return;
+    }
+    uint32_t length = message != NULL ? message->length : inframe->msg_len;
+    if ((!file && length > MAX_MESSAGE_SIZE) || inframe->offset > length) {
+        return;
+    }
+    uint32_t fragment = length - inframe->offset;
+    if (fragment > inframe->data_length) {
+        fragment = inframe->data_length;
+    }
+    if (message == NULL && !file && fragment == length) {
+        output_message(receiver, inframe->data, length);
+        return;
+    }
+
+    if (message == NULL) {
+        if (file) {
+            message = file_open(receiver, peer, inframe, fragment);
+            if (message == NULL) {
+                return;
+            }
+        } else {
+            message = calloc(1, sizeof(Reassembly));
+            assert(message);
+            // NUL-terminated as well, for hooks that want a string
+            message->buffer = malloc(length + 1);
+            assert(message->buffer);
+            message->buffer[length] = '\0';
+            message->length = length;
+            message->fd = -1;
+        }
+        peer_table_put(&peer->messages, inframe->msg_id, message);
+    }
+
+    if (file) {
+        file_write(message, inframe, fragment);
+    } else {
+        memcpy(message->buffer + inframe->offset, inframe->data, fragment);
+    }
+    message->received += fragment;
+    if (message->received == message->length) {
+        peer_table_remove(&peer->messages, inframe->msg_id);
+        if (file) {
+            message->file_position += message->length - message->data_offset;
+            if (message->more) {
+                peer->file = message;
+                return;
+            }
+            file_close(receiver, message);
+        } else {
+            output_message(receiver, message->buffer, length);
+        }
+        free_reassembly(message);
+    }
+}
+
+// Cumulative ACK: seqNum is the highest frame delivered in order and
+// msg_len names the frame that triggered it (for Selective Repeat). Behind
+// a gap, the SACK bitmap lists the frames buffered past it, as far as the
+// frame has room. It covers every frame waiting for a delayed ACK.
+static void send_ack(Receiver* receiver, RecvPeer* peer, seq_t trigger_seq,
+                     LLlist* outgoing_frames) {
+    Frame outgoing_frame;
+    memset(&outgoing_frame, 0, sizeof(Frame));
+    outgoing_frame.flags = 'a';
+    outgoing_frame.seqNum = peer->LFR;
+    outgoing_frame.src_id = peer->src_id;
+    outgoing_frame.dst_id = receiver->recv_id;
+    outgoing_frame.msg_len = trigger_seq;
+
+    if (peer->buffered > 0) {
+        uint32_t bits = receiver->RWS;
+        if (bits > frame_capacity(&outgoing_frame) * 8) {
+            bits = frame_capacity(&outgoing_frame) * 8;
+        }
+        // Bit 0 is LFR + 1 itself, which is never buffered
+        for (uint32_t i = 1; i < bits; i++) {
+            seq_t seq = peer->LFR + 1 + i;
+            if (peer->recv_ring[seq & receiver->recv_mask].present) {
+                outgoing_frame.data[i / 8] |= 1 << (i % 8);
+                outgoing_frame.data_length = i / 8 + 1;
+            }
+        }
+    }
+
+    char* outgoing_charbuf = wire_alloc();
+    frame_encode(&outgoing_frame, outgoing_charbuf);
+    ll_list_append(outgoing_frames, outgoing_charbuf);
+    stats_inc(&receiver->stats.acks_sent);
+
+    peer->unacked = 0;
+    timer_wheel_cancel(receiver->timer_wheel, &peer->ack_timer);
+}
+
+// Hold back the ACK for an in-order frame: it goes out at the end of the
+// batch once ack_every frames are waiting or the frame is a whole message
+// (someone is likely waiting on it), and otherwise when ack_timer fires
+static void delay_ack(Receiver* receiver, RecvPeer* peer, Frame* inframe) {
+    peer->unacked++;
+    peer->ack_trigger = inframe->seqNum;
+
+    int whole_message =
+        inframe->offset == 0 && inframe->msg_len <= inframe->data_length;
+    if (peer->unacked >= (uint32_t) glb_sysconfig.ack_every || whole_message) {
+        if (!peer->ack_queued) {
+            peer->ack_queued = 1;
+            peer->ack_next = receiver->ack_list;
+            receiver->ack_list = peer;
+        }
+    } else if (!peer->ack_timer.armed) {
+        timer_wheel_insert(receiver->timer_wheel, &peer->ack_timer,
+                           current_time_usec() + glb_sysconfig.ack_delay_usec);
+    }
+}
+
+// One ACK for each peer queued by delay_ack during the batch
+static void flush_acks(Receiver* receiver, LLlist* outgoing_frames) {
+    while (receiver->ack_list != NULL) {
+        RecvPeer* peer = receiver->ack_list;
+        receiver->ack_list = peer->ack_next;
+        peer->ack_queued = 0;
+        // Unless an immediate ACK already covered it
+        if (peer->unacked > 0) {
+            send_ack(receiver, peer, peer->ack_trigger, outgoing_frames);
+        }
+    }
+}
+
+// Buffer any frame inside the window and deliver everything that is now in
+// order. Every valid frame addressed to us is acknowledged, including ones
+// already delivered (their ACK may have been lost). The next in-order frame
+// may have its ACK delayed; anything else (a gap, a duplicate, or a frame
+// that fills a gap) is acknowledged at once so the sender hears about it.
+static void handle_data_frame(Receiver* receiver, Frame* inframe,
+                              LLlist* outgoing_frames) {
+    if (inframe->remainder != 0) {
+        stats_inc(&receiver->stats.crc_failures);
+        return;
+    }
+    if (inframe->dst_id != receiver->recv_id ||
+        inframe->src_id >= glb_senders_array_length) {
+        stats_inc(&receiver->stats.frames_ignored);
+        return;
+    }
+    stats_inc(&receiver->stats.frames_received);
+
+    RecvPeer* peer = receiver_peer(receiver, inframe->src_id);
+    int delayable = 0;
+    if (seq_in_window(inframe->seqNum, peer->LFR + 1, receiver->RWS)) {
+        RecvSlot* slot = &peer->recv_ring[inframe->seqNum & receiver->recv_mask];
+        if (slot->present) {
+            stats_inc(&receiver->stats.duplicates);
+        } else {
+            slot->frame = *inframe;
+            slot->present = 1;
+            peer->buffered++;
+            if (inframe->seqNum != (seq_t) (peer->LFR + 1)) {
+                stats_inc(&receiver->stats.out_of_order);
+            }
+        }
+
+        seq_t next_seq = peer->LFR + 1;
+        slot = &peer->recv_ring[next_seq & receiver->recv_mask];
+        while (slot->present) {
+            deliver_frame(receiver, peer, &slot->frame);
+            slot->present = 0;
+            peer->buffered--;
+            peer->LFR = next_seq++;
+            slot = &peer->recv_ring[next_seq & receiver->recv_mask];
+        }
+        peer->LAF = peer->LFR + receiver->RWS;
+        delayable = peer->LFR == inframe->seqNum && glb_sysconfig.ack_every > 1;
+    } else if (seq_le(inframe->seqNum, peer->LFR)) {
+        stats_inc(&receiver->stats.duplicates);
+    } else {
+        stats_inc(&receiver->stats.out_of_window);
+    }
+
+    if (delayable) {
+        delay_ack(receiver, peer, inframe);
+    } else {
+        send_ack(receiver, peer, inframe->seqNum, outgoing_frames);
+    }
+}
+
+// State handed to the delayed ACK timer callback
+struct ReceiverExpiry_t {
+    Receiver* receiver;
+    LLlist* outgoing_frames;
+};
+
+static void ack_timedout(TimerEntry* timer, void* arg) {
+    struct ReceiverExpiry_t* expiry = arg;
+    RecvPeer* peer = container_of(timer, RecvPeer, ack_timer);
+
+    send_ack(expiry->receiver, peer, peer->ack_trigger, expiry->outgoing_frames);
+    stats_inc(&expiry->receiver->stats.acks_delayed);
+}
+
+// Next delayed ACK deadline in usec, or -1 if no ACK is being held back
+static long receiver_get_next_deadline(Receiver* receiver) {
+    return timer_wheel_next_deadline(receiver->timer_wheel);
+}
+
+// Send the delayed ACKs that are due
+static void handle_delayed_acks(Receiver* receiver, LLlist* outgoing_frames) {
+    long now = current_time_usec();
+    long deadline = receiver_get_next_deadline(receiver);
+
+    if (deadline < 0 || deadline > now) {
+        return;
+    }
+
+    struct ReceiverExpiry_t expiry = { receiver, outgoing_frames };
+    timer_wheel_expire(receiver->timer_wheel, now, ack_timedout, &expiry);
+}
+
+// Decode one frame off the wire, release its buffer and handle it
+static void handle_wire_frame(Receiver* receiver, char* raw_char_buf,
+                              LLlist* outgoing_frames) {
+    Frame inframe;
+    frame_decode(raw_char_buf, &inframe);
+
+    // Free raw_char_buf
+    wire_free(raw_char_buf);
+
+    handle_data_frame(receiver, &inframe, outgoing_frames);
+}
+
+// Runs without buffer_mutex: incoming_msgs_head was already spliced out of
+// the inbox (and is NULL with the lock-free inbox, which we drain here)
+void handle_incoming_msgs(Receiver* receiver, LLnode* incoming_msgs_head,
+                          LLlist* outgoing_frames) {
     // TODO: Suggested steps for handling incoming frames
     //    1) Dequeue the Frame from the sender->input_framelist_head
     //    2) Convert the char * buffer to a Frame data type
     //    3) Check whether the frame is for this receiver
     //    4) Acknowledge that this frame was received
 
-    int incoming_msgs_length = ll_get_length(receiver->input_framelist_head);
-    while (incoming_msgs_length > 0) {
-        // Pop a node off the front of the link list and update the count
-        LLnode* ll_inmsg_node = ll_pop_node(&receiver->input_framelist_head);
-        incoming_msgs_length = ll_get_length(receiver->input_framelist_head);
-
-        char* raw_char_buf = ll_inmsg_node->value;
-        Frame* inframe = convert_char_to_frame(raw_char_buf);
-
-        // Free raw_char_buf
-        free(raw_char_buf);
-        
-
-        // If message is for me and it is within the frame
-        if (inframe->remainder == 0 && inframe->dst_id == receiver->recv_id && (inframe->seqNum > receiver->LFR || (inframe->seqNum == 0 && receiver->LFR ==MAX_SEQ )) && inframe->seqNum <= receiver->LAF ) {
-            // Print (if not already received)
-            uint8_t packet_next_id = (uint8_t) (inframe->seqNum + 1);
-
-            // Update sliding window
-            receiver->LFR = inframe->seqNum;
-            receiver->LAF = receiver->RWS + receiver->LFR ;
-
-
-            
-            if (packet_next_id > receiver->sender_seq_ids[inframe->src_id] || (packet_next_id == 0 &&  receiver->LAF == 0 )) {
-                if(inframe->flags == 's'){
-                    receiver->long_msg = malloc(inframe->msg_len);
-                    memcpy(receiver->long_msg, inframe->data, FRAME_PAYLOAD_SIZE);
-
-                }
-                else if (inframe->flags == 'c'){
-                    int len = strlen(receiver->long_msg);
-                    memcpy(receiver->long_msg + len, inframe->data, FRAME_PAYLOAD_SIZE);
-                }
-                else if (inframe->flags == 'f'){
-                    int len = strlen(receiver->long_msg);
-                    memcpy(receiver->long_msg + len, inframe->data, strlen(inframe->data));
-                    printf("<RECV_%d>:[%s]\n", receiver->recv_id, receiver->long_msg);
-                }
-                else{
-                    printf("<RECV_%d>:[%s]\n", receiver->recv_id, inframe->data);
-                }
-                receiver->sender_seq_ids[inframe->src_id] = packet_next_id;
-            }
-        }
-        else if(inframe->remainder == 0 && inframe->dst_id != receiver->recv_id && (inframe->seqNum > receiver->LFR || (inframe->seqNum == 0 && receiver->LFR ==MAX_SEQ )) && inframe->seqNum <= receiver->LAF ){
-            // Update sliding window
-            receiver->LFR = inframe->seqNum;
-            receiver->LAF = receiver->RWS + receiver->LFR ;
-        }
-
-        // Send acknowledgement.
-        Frame* outgoing_frame = calloc(1, sizeof(Frame));
-        memcpy(outgoing_frame, inframe, sizeof(Frame));
-        outgoing_frame->flags = 'a';
+    unsigned long batch = 0;
 
-        char* outgoing_charbuf = convert_frame_to_char(outgoing_frame);
-        ll_append_node(outgoing_frames_head_ptr, outgoing_charbuf);
-        free(outgoing_frame);
+    if (glb_sysconfig.lockfree_inbox) {
+        char* raw_char_buf;
+        while ((raw_char_buf = mpsc_pop(&receiver->frame_inbox)) != NULL) {
+            handle_wire_frame(receiver, raw_char_buf, outgoing_frames);
+            batch++;
+        }
+    } else {
+        LLnode* ll_inmsg_node;
 
-        free(inframe);
-        free(ll_inmsg_node);
+        while ((ll_inmsg_node = ll_pop_node(&incoming_msgs_head)) != NULL) {
+            handle_wire_frame(receiver, ll_inmsg_node->value, outgoing_frames);
+            ll_free_node(ll_inmsg_node);
+            batch++;
+        }
     }
+    stats_max(&receiver->stats.max_inbox_batch, batch);
+    flush_acks(receiver, outgoing_frames);
 }
 
 void* run_receiver(void* input_receiver) {
@@ -98,7 +525,9 @@ void* run_receiver(void* input_receiver) {
     const int WAIT_SEC_TIME = 0;
     const long WAIT_USEC_TIME = 100000;
     Receiver* receiver = (Receiver*) input_receiver;
-    LLnode* outgoing_frames_head;
+    LLlist outgoing_frames;
+    LLnode* ll_outframe_node;
+    long sleep_usec_time;
 
     // This incomplete receiver thread, at a high level, loops as follows:
     // 1. Determine the next time the thread should wake up if there is nothing
@@ -108,19 +537,24 @@ void* run_receiver(void* input_receiver) {
     // 4. Releases the lock
     // 5. Sends out any outgoing messages
 
-    while (1) {
+    while (!atomic_load(&receiver->stopping)) {
         // NOTE: Add outgoing messages to the outgoing_frames_head pointer
-        outgoing_frames_head = NULL;
+        ll_list_init(&outgoing_frames);
         gettimeofday(&curr_timeval, NULL);
 
-        // Either timeout or get woken up because you've received a datagram
-        // NOTE: You don't really need to do anything here, but it might be
-        // useful for debugging purposes to have the receivers periodically
-        // wakeup and print info
+        // Either timeout or get woken up because you've received a datagram.
+        // The timeout is the next delayed ACK, if any is being held back.
         time_spec.tv_sec = curr_timeval.tv_sec;
         time_spec.tv_nsec = curr_timeval.tv_usec * 1000;
-        time_spec.tv_sec += WAIT_SEC_TIME;
-        time_spec.tv_nsec += WAIT_USEC_TIME * 1000;
+        long deadline = receiver_get_next_deadline(receiver);
+        sleep_usec_time = WAIT_SEC_TIME * 1000000L + WAIT_USEC_TIME;
+        if (deadline >= 0) {
+            sleep_usec_time = deadline - current_time_usec();
+        }
+        if (sleep_usec_time > 0) {
+            time_spec.tv_sec += sleep_usec_time / 1000000;
+            time_spec.tv_nsec += sleep_usec_time % 1000000 * 1000;
+        }
         if (time_spec.tv_nsec >= 1000000000) {
             time_spec.tv_sec++;
             time_spec.tv_nsec -= 1000000000;
@@ -131,39 +565,80 @@ void* run_receiver(void* input_receiver) {
         //      between the mutex lock and unlock, because other threads
         //      CAN/WILL access these structures
         //*****************************************************************************************
-        pthread_mutex_lock(&receiver->buffer_mutex);
+        LLnode* incoming_msgs_head = NULL;
+        if (glb_sysconfig.lockfree_inbox) {
+            // Lock-free inbox: park on the eventfd instead of the condvar
+            MpscQueue* inboxes[] = { &receiver->frame_inbox };
+            if (glb_sysconfig.epoll_backend) {
+                // No deadline means no ACK held back: sleep until pushed to
+                event_loop_wait(&receiver->event_loop, &receiver->inbox_waker,
+                                inboxes, 1, deadline);
+            } else {
+                mpsc_waker_wait(&receiver->inbox_waker, inboxes, 1, &time_spec);
+            }
+        } else {
+            pthread_mutex_lock(&receiver->buffer_mutex);
 
-        // Check whether anything arrived
-        int incoming_msgs_length =
-            ll_get_length(receiver->input_framelist_head);
-        if (incoming_msgs_length == 0) {
-            // Nothing has arrived, do a timed wait on the condition variable
-            // (which releases the mutex). Again, you don't really need to do
-            // the timed wait. A signal on the condition variable will wake up
-            // the thread and reacquire the lock
-            pthread_cond_timedwait(&receiver->buffer_cv,
-                                   &receiver->buffer_mutex, &time_spec);
-        }
+            // Check whether anything arrived
+            if (receiver->input_framelist_head == NULL &&
+                !atomic_load(&receiver->stopping) && sleep_usec_time > 0) {
+                // Nothing has arrived, do a timed wait on the condition
+                // variable (which releases the mutex). Again, you don't
+                // really need to do the timed wait. A signal on the
+                // condition variable will wake up the thread and reacquire
+                // the lock
+                pthread_cond_timedwait(&receiver->buffer_cv,
+                                       &receiver->buffer_mutex, &time_spec);
+            }
 
-        handle_incoming_msgs(receiver, &outgoing_frames_head);
+            // Only swap the inbox out under the lock; decoding, delivery
+            // (including the printf) and ACKs run after producers are let
+            // back in
+            long hold_start = monotonic_time_nsec();
+            incoming_msgs_head = ll_splice(&receiver->input_framelist_head);
+            pthread_mutex_unlock(&receiver->buffer_mutex);
+            stats_add(&receiver->stats.lock_hold_nsec,
+                      monotonic_time_nsec() - hold_start);
+            stats_inc(&receiver->stats.lock_holds);
+        }
 
-        pthread_mutex_unlock(&receiver->buffer_mutex);
+        handle_incoming_msgs(receiver, incoming_msgs_head, &outgoing_frames);
+        handle_delayed_acks(receiver, &outgoing_frames);
 
         // CHANGE THIS AT YOUR OWN RISK!
         // Send out all the frames user has appended to the outgoing_frames list
-        int ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
-        while (ll_outgoing_frame_length > 0) {
-            LLnode* ll_outframe_node = ll_pop_node(&outgoing_frames_head);
+        while ((ll_outframe_node = ll_list_pop(&outgoing_frames)) != NULL) {
             char* char_buf = (char*) ll_outframe_node->value;
 
             // The following function frees the memory for the char_buf object
             send_msg_to_senders(char_buf);
 
             // Free up the ll_outframe_node
-            free(ll_outframe_node);
-
-            ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
+            ll_free_node(ll_outframe_node);
         }
     }
     pthread_exit(NULL);
 }
+
+// After each batch the task parks until the next frame is pushed or the next
+// delayed ACK is due
+void run_receiver_task(Task* task) {
+    Receiver* receiver = container_of(task, Receiver, task);
+    LLlist outgoing_frames;
+    LLnode* ll_outframe_node;
+
+    if (atomic_load(&receiver->stopping)) {
+        return;
+    }
+
+    ll_list_init(&outgoing_frames);
+    handle_incoming_msgs(receiver, NULL, &outgoing_frames);
+    handle_delayed_acks(receiver, &outgoing_frames);
+
+    while ((ll_outframe_node = ll_list_pop(&outgoing_frames)) != NULL) {
+        send_msg_to_senders(ll_outframe_node->value);
+        ll_free_node(ll_outframe_node);
+    }
+
+    task_park(task, receiver_get_next_deadline(receiver));
+}
@@ -17,6 +17,10 @@
 #include <unistd.h>
 
 void init_receiver(Receiver*, int);
+void destroy_receiver(Receiver*);
+void receiver_request_stop(Receiver*);
 void* run_receiver(void*);
+// One round of run_receiver for the worker pool (-w)
+void run_receiver_task(Task*);
 
 #endif
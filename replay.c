@@ -0,0 +1,288 @@
+// mmap and clock_nanosleep are POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "replay.h"
+#include "stats.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Commands for one sender that have not been handed over yet
+struct ReplayBatch_t {
+    Sender* sender;
+    int length;
+    Cmd* cmds[REPLAY_BATCH_SIZE];
+};
+typedef struct ReplayBatch_t ReplayBatch;
+
+// A word of the mapped script; never NUL-terminated
+struct ReplayToken_t {
+    const char* start;
+    size_t length;
+};
+typedef struct ReplayToken_t ReplayToken;
+
+static void push_cmds(Sender* sender, Cmd** cmds, int cmds_length) {
+    if (glb_sysconfig.lockfree_inbox) {
+        mpsc_push_batch(&sender->cmd_inbox, (void**) cmds, cmds_length);
+        return;
+    }
+
+    // Link the nodes before taking the lock, then splice them in at once
+    LLlist batch;
+    ll_list_init(&batch);
+    for (int i = 0; i < cmds_length; i++) {
+        ll_list_append(&batch, cmds[i]);
+    }
+
+    pthread_mutex_lock(&sender->buffer_mutex);
+    LLlist inbox = { sender->input_cmdlist_head, 0 };
+    ll_list_concat(&inbox, &batch);
+    sender->input_cmdlist_head = inbox.head;
+    pthread_cond_signal(&sender->buffer_cv);
+    pthread_mutex_unlock(&sender->buffer_mutex);
+}
+
+static void batch_flush(ReplayBatch* batch) {
+    if (batch->length > 0) {
+        push_cmds(batch->sender, batch->cmds, batch->length);
+        batch->length = 0;
+    }
+}
+
+static void batches_flush(ReplayBatch* batches) {
+    for (int i = 0; i < glb_senders_array_length; i++) {
+        batch_flush(&batches[i]);
+    }
+}
+
+// Sleep until the monotonic deadline. Simulation plays the transfer out up
+// to the deadline instead, so the script and the endpoints share one clock.
+static void replay_wait(long deadline_usec) {
+    struct timespec wake_at;
+
+    if (glb_sysconfig.simulate) {
+        sim_run_until(deadline_usec);
+        return;
+    }
+    wake_at.tv_sec = deadline_usec / 1000000;
+    wake_at.tv_nsec = deadline_usec % 1000000 * 1000;
+    // Only a signal cuts the sleep short; anything else would fail again
+    int error;
+    do {
+        error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_at, NULL);
+    } while (error == EINTR);
+    if (error != 0) {
+        fprintf(stderr, "replay: clock_nanosleep: %s\n", strerror(error));
+    }
+}
+
+// Skip blanks, then take the next word of [*cursor, end)
+static int next_token(const char** cursor, const char* end, ReplayToken* token) {
+    const char* p = *cursor;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    token->start = p;
+    while (p < end && *p != ' ' && *p != '\t') {
+        p++;
+    }
+    token->length = p - token->start;
+    *cursor = p;
+    return token->length > 0;
+}
+
+static int token_is(const ReplayToken* token, const char* word) {
+    size_t word_length = strlen(word);
+    return token->length == word_length &&
+           memcmp(token->start, word, word_length) == 0;
+}
+
+// A non-negative decimal, optionally followed by suffix (e.g. "/s")
+static int token_number(const ReplayToken* token, const char* suffix,
+                        long* value) {
+    size_t i = 0;
+    *value = 0;
+    while (i < token->length && token->start[i] >= '0' && token->start[i] <= '9') {
+        if (*value > (LONG_MAX - 9) / 10) {
+            return 0;
+        }
+        *value = *value * 10 + token->start[i++] - '0';
+    }
+    size_t rest = token->length - i;
+    return i > 0 && (rest == 0 || (rest == strlen(suffix) &&
+                                   memcmp(token->start + i, suffix, rest) == 0));
+}
+
+// msg and file: "<src> <dst> <rest of the line>"
+static Cmd* parse_cmd(const char* cursor, const char* end, int file) {
+    ReplayToken src, dst;
+    long src_id, dst_id;
+
+    if (!next_token(&cursor, end, &src) || !token_number(&src, "", &src_id) ||
+        !next_token(&cursor, end, &dst) || !token_number(&dst, "", &dst_id) ||
+        src_id >= glb_senders_array_length || dst_id >= glb_receivers_array_length) {
+        return NULL;
+    }
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+        cursor++;
+    }
+    size_t rest_length = end - cursor;
+    if (rest_length == 0 || (!file && rest_length > MAX_MESSAGE_SIZE)) {
+        return NULL;
+    }
+
+    // The one copy: the command owns its message
+    Cmd* cmd = calloc(1, sizeof(Cmd));
+    char* rest = malloc(rest_length + 1);
+    assert(cmd && rest);
+    memcpy(rest, cursor, rest_length);
+    rest[rest_length] = '\0';
+    cmd->src_id = src_id;
+    cmd->dst_id = dst_id;
+
+    if (file) {
+        int mapped = cmd_map_file(cmd, rest);
+        free(rest);
+        if (mapped < 0) {
+            free(cmd);
+            return NULL;
+        }
+    } else {
+        cmd->message = rest;
+        cmd->length = rest_length;
+    }
+    return cmd;
+}
+
+void* run_replay(void* threadid) {
+    struct stat script_stat;
+    const char* path = glb_sysconfig.automated_file;
+    (void) threadid;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &script_stat) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    const char* script = NULL;
+    size_t script_length = script_stat.st_size;
+    if (script_length > 0) {
+        script = mmap(NULL, script_length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (script == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+        posix_madvise((void*) script, script_length, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    ReplayBatch* batches = malloc(glb_senders_array_length * sizeof(ReplayBatch));
+    assert(batches);
+    for (int i = 0; i < glb_senders_array_length; i++) {
+        batches[i].sender = &glb_senders_array[i];
+        batches[i].length = 0;
+    }
+
+    // Script time in nsec from the start: when the next command is due, and
+    // how far we have waited. rate only spaces out commands.
+    long origin_usec = current_time_usec();
+    long wall_start_nsec = monotonic_time_nsec();
+    long due_nsec = 0;
+    long reached_nsec = 0;
+    long interval_nsec = 0;
+    unsigned long replayed = 0;
+    int line_number = 0;
+
+    const char* line = script;
+    const char* script_end = script + script_length;
+    while (line < script_end) {
+        const char* line_end = memchr(line, '\n', script_end - line);
+        const char* next_line = line_end != NULL ? line_end + 1 : script_end;
+        if (line_end == NULL) {
+            line_end = script_end;
+        }
+        if (line_end > line && line_end[-1] == '\r') {
+            line_end--;
+        }
+        line_number++;
+
+        const char* cursor = line;
+        ReplayToken command;
+        line = next_line;
+        if (!next_token(&cursor, line_end, &command) || command.start[0] == '#') {
+            continue;
+        }
+
+        int is_file = token_is(&command, "file");
+        if (token_is(&command, "msg") || is_file) {
+            Cmd* cmd = parse_cmd(cursor, line_end, is_file);
+            if (cmd == NULL) {
+                fprintf(stderr, "%s:%d: ill-formatted %s\n", path, line_number,
+                        is_file ? "file" : "msg");
+                continue;
+            }
+
+            // Flush before sleeping so nothing waits in a batch meanwhile
+            if (due_nsec > reached_nsec + REPLAY_SLACK_USEC * 1000L) {
+                batches_flush(batches);
+                replay_wait(origin_usec + due_nsec / 1000);
+                reached_nsec = due_nsec;
+            }
+
+            ReplayBatch* batch = &batches[cmd->src_id];
+            batch->cmds[batch->length++] = cmd;
+            if (batch->length == REPLAY_BATCH_SIZE) {
+                batch_flush(batch);
+            }
+            replayed++;
+            due_nsec += interval_nsec;
+        } else if (token_is(&command, "rate")) {
+            ReplayToken rate;
+            long per_second;
+            if (!next_token(&cursor, line_end, &rate) ||
+                !token_number(&rate, "/s", &per_second)) {
+                fprintf(stderr, "%s:%d: expected rate N/s\n", path, line_number);
+                continue;
+            }
+            interval_nsec = per_second > 0 ? 1000000000L / per_second : 0;
+        } else if (token_is(&command, "sleep")) {
+            ReplayToken pause;
+            long pause_msec;
+            if (!next_token(&cursor, line_end, &pause) ||
+                !token_number(&pause, "ms", &pause_msec)) {
+                fprintf(stderr, "%s:%d: expected sleep ms\n", path, line_number);
+                continue;
+            }
+            due_nsec += pause_msec * 1000000L;
+        } else if (token_is(&command, "stats")) {
+            batches_flush(batches);
+            stats_print(stderr);
+        } else if (token_is(&command, "exit")) {
+            break;
+        } else {
+            fprintf(stderr, "%s:%d: unknown command\n", path, line_number);
+        }
+    }
+    batches_flush(batches);
+
+    double wall_sec = (monotonic_time_nsec() - wall_start_nsec) / 1e9;
+    fprintf(stderr, "Replayed %lu commands in %.3fs (%.0f/s)\n", replayed,
+            wall_sec, wall_sec > 0 ? replayed / wall_sec : 0.0);
+
+    free(batches);
+    if (script != NULL) {
+        munmap((void*) script, script_length);
+    }
+    return NULL;
+}
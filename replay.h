@@ -0,0 +1,20 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "common.h"
+
+// Automated mode (-a file): replays a script of stdin commands as a load
+// generator. The script is mapped and tokenized in place, and commands reach
+// each sender in batches, one lock acquisition or queue exchange per batch.
+// Besides msg, file, stats and exit a script may use
+//   rate N/s   pace the commands that follow at N per second (0: no limit)
+//   sleep ms   pause before the next command
+// Blank lines and lines starting with # are skipped. Under --simulate the
+// pacing runs on the virtual clock.
+#define REPLAY_BATCH_SIZE 256
+// Commands due within this long of the last wait go out without another
+#define REPLAY_SLACK_USEC 1000
+
+void* run_replay(void*);
+
+#endif
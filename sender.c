@@ -1,10 +1,22 @@
 #include "sender.h"
+#include "stats.h"
 
 #include <assert.h>
 
-#define WINDOW_SIZE 8;
-
-static const MAX_SEQ = 255;
+// Retransmission timeout before the first RTT sample, and its bounds
+#define INITIAL_RTO_USEC 90000
+#define MIN_RTO_USEC 1000
+#define MAX_RTO_USEC 1000000
+// Clock granularity term of the RTO (one timing wheel tick)
+#define RTO_GRANULARITY_USEC TIMER_WHEEL_TICK_USEC
+// Duplicate ACKs that trigger a fast retransmit
+#define FAST_RETRANSMIT_DUP_ACKS 3
+// Congestion window of a new peer (RFC 6928), and the least ssthresh a loss
+// leaves
+#define INITIAL_CWND 10
+#define MIN_SSTHRESH 2
+// How early the pacer lets a frame go, to cover the latency of waking up
+#define PACING_SLACK_USEC 50
 
 void init_sender(Sender* sender, int id) {
     pthread_cond_init(&sender->buffer_cv, NULL);
@@ -12,191 +24,757 @@ void init_sender(Sender* sender, int id) {
     sender->send_id = id;
     sender->input_cmdlist_head = NULL;
     sender->input_framelist_head = NULL;
-    
-    sender->timeout_timeval = NULL;
-    sender->buffer_framelist_head = NULL;
-    sender->window_buffer_head = NULL;
+    if (glb_sysconfig.worker_pool || glb_sysconfig.simulate) {
+        task_init(&sender->task, &sender->inbox_waker, run_sender_task);
+    } else {
+        mpsc_waker_init(&sender->inbox_waker);
+    }
+    mpsc_init(&sender->cmd_inbox, &sender->inbox_waker);
+    mpsc_init(&sender->frame_inbox, &sender->inbox_waker);
+    if (glb_sysconfig.epoll_backend) {
+        event_loop_init(&sender->event_loop, &sender->inbox_waker);
+    }
+    atomic_init(&sender->draining, 0);
+    sender->drain_latch = NULL;
+    sender->packet_id = 0;
+
+    sender->ready_head = NULL;
+    sender->ready_tail = NULL;
+    sender->pending_cmds = 0;
 
     // Sliding window initialization
-    sender->seqNum = MAX_SEQ;
-    sender->SWS = WINDOW_SIZE;
-    sender->LFS = MAX_SEQ;
-    sender->LAR = MAX_SEQ;
+    sender->SWS = glb_sysconfig.send_window_size;
+    sender->in_flight = 0;
+    peer_table_init(&sender->peers);
+
+    // Smallest power of two that holds a full window; it always divides the
+    // sequence space, so slots stay consistent across wraparound
+    uint32_t window_capacity = 1;
+    while (window_capacity < sender->SWS) {
+        window_capacity <<= 1;
+    }
+    sender->window_mask = window_capacity - 1;
+
+    // The congestion window never outgrows the send window, nor what a
+    // receiver will buffer
+    sender->max_cwnd = sender->SWS;
+    if (glb_sysconfig.congestion_control == cc_aimd &&
+        (uint32_t) glb_sysconfig.recv_window_size < sender->max_cwnd) {
+        sender->max_cwnd = glb_sysconfig.recv_window_size;
+    }
+
+    sender->timer_wheel = malloc(sizeof(TimerWheel));
+    assert(sender->timer_wheel);
+    timer_wheel_init(sender->timer_wheel, current_time_usec());
+
+    sender->srtt_usec = -1;
+    sender->min_rtt_usec = -1;
+    sender->rttvar_usec = 0;
+    sender->rto_usec = INITIAL_RTO_USEC;
+    memset(&sender->stats, 0, sizeof(SenderStats));
+    stats_set(&sender->stats.rto_usec, sender->rto_usec);
 }
 
-struct timeval* sender_get_next_expiring_timeval(Sender* sender) {
-    // No buffered msg => no expiration time
-    // if (sender->pending_frame == NULL) {
-    //     return NULL;
-    // }
-    if (sender->window_buffer_head == NULL || ll_get_length(sender->window_buffer_head) == 0) {
-        return NULL;
+static void free_send_peer(void* value) {
+    SendPeer* peer = value;
+    LLnode* ll_node;
+
+    // Only left over if we never drained
+    while ((ll_node = ll_list_pop(&peer->pending_cmds)) != NULL) {
+        cmd_free(ll_node->value);
+        ll_free_node(ll_node);
     }
+    free(peer->window_ring);
+    free(peer);
+}
 
-    // Expiration time in the next 0.09 seconds (90ms)
-    struct timeval* exp_timeval = malloc(sizeof(struct timeval));
-    gettimeofday(exp_timeval, NULL);
-    exp_timeval->tv_usec += 90000;
-    exp_timeval->tv_sec += 0;
+void destroy_sender(Sender* sender) {
+    LLnode* ll_node;
+    char* raw_char_buf;
 
+    // ACKs that arrived after we drained
+    while ((ll_node = ll_pop_node(&sender->input_framelist_head)) != NULL) {
+        wire_free(ll_node->value);
+        ll_free_node(ll_node);
+    }
+    while ((raw_char_buf = mpsc_pop(&sender->frame_inbox)) != NULL) {
+        wire_free(raw_char_buf);
+    }
+
+    peer_table_destroy(&sender->peers, free_send_peer);
+    free(sender->timer_wheel);
+    if (glb_sysconfig.epoll_backend) {
+        event_loop_destroy(&sender->event_loop);
+    }
+    mpsc_waker_destroy(&sender->inbox_waker);
+}
+
+// Window state for one receiver, created the first time we send to it
+static SendPeer* sender_peer(Sender* sender, uint16_t dst_id) {
+    SendPeer* peer = peer_table_get(&sender->peers, dst_id);
+    if (peer == NULL) {
+        peer = calloc(1, sizeof(SendPeer));
+        assert(peer);
+        peer->LFS = MAX_SEQ;
+        peer->LAR = MAX_SEQ;
+        peer->window_ring = calloc(sender->window_mask + 1, sizeof(WindowSlot));
+        assert(peer->window_ring);
+        // A fixed window starts, and stays, at its full size
+        peer->cwnd = sender->max_cwnd;
+        if (glb_sysconfig.congestion_control == cc_aimd &&
+            INITIAL_CWND < sender->max_cwnd) {
+            peer->cwnd = INITIAL_CWND;
+        }
+        peer->ssthresh = sender->max_cwnd;
+        ll_list_init(&peer->pending_cmds);
+        peer_table_put(&sender->peers, dst_id, peer);
+    }
+    return peer;
+}
 
-    // Format time
-    exp_timeval->tv_sec += exp_timeval->tv_usec / 1000000;
-    exp_timeval->tv_usec %= 1000000;
+// Number of frames sent to this peer but not yet acknowledged
+static inline int window_length(SendPeer* peer) {
+    return seq_offset(peer->LAR, peer->LFS);
+}
 
-    return exp_timeval;
+static inline WindowSlot* window_slot(Sender* sender, SendPeer* peer,
+                                      seq_t seqNum) {
+    return &peer->window_ring[seqNum & sender->window_mask];
 }
 
-void handle_incoming_acks(Sender* sender, LLnode** outgoing_frames_head_ptr) {
-    // If I received a msg from a receiver...
-    int incoming_msgs_length = ll_get_length(sender->input_framelist_head);
-    while (incoming_msgs_length > 0) {
-        // Pop a node off the front of the link list and update the count
-        LLnode* ll_inmsg_node = ll_pop_node(&sender->input_framelist_head);
-        incoming_msgs_length = ll_get_length(sender->input_framelist_head);
-        
-        char* raw_char_buf = ll_inmsg_node->value;
-        Frame* inframe = convert_char_to_frame(raw_char_buf);
-
-        // Free raw_char_buf
-        free(raw_char_buf);
-
-        // If acknowledgement is for me..
-        int length = ll_get_length(sender->window_buffer_head);
-
-        uint8_t acceptable_seq = sender->LAR + 1;
-        if (length > 0 && inframe->remainder == 0 && inframe->src_id == sender->send_id && inframe->seqNum == acceptable_seq) {
-            ll_pop_node(&sender->window_buffer_head);
-            sender->LAR++;
-            // Clear timeout interval & buffer
-            free(sender->timeout_timeval);
-            sender->timeout_timeval = NULL;
+// Frames in flight the receiver has not acknowledged in any way
+static inline uint32_t window_pipe(SendPeer* peer) {
+    return window_length(peer) - peer->sacked;
+}
+
+// Whether the peer's window has room for another frame. The congestion
+// window bounds the unacknowledged frames; max_cwnd still bounds the whole
+// window, holes and SACKed frames included.
+static int window_open(Sender* sender, SendPeer* peer) {
+    return (uint32_t) window_length(peer) < sender->max_cwnd &&
+           window_pipe(peer) < peer->cwnd;
+}
+
+// The ready list holds the peers with commands waiting, in round-robin order
+static void ready_append(Sender* sender, SendPeer* peer) {
+    peer->ready_next = NULL;
+    if (sender->ready_tail != NULL) {
+        sender->ready_tail->ready_next = peer;
+    } else {
+        sender->ready_head = peer;
+    }
+    sender->ready_tail = peer;
+}
+
+// prev is the peer before this one on the ready list, NULL for the head
+static void ready_unlink(Sender* sender, SendPeer* prev, SendPeer* peer) {
+    if (prev != NULL) {
+        prev->ready_next = peer->ready_next;
+    } else {
+        sender->ready_head = peer->ready_next;
+    }
+    if (sender->ready_tail == peer) {
+        sender->ready_tail = prev;
+    }
+}
+
+// The first peer on the ready list whose window has room for a frame and
+// whose pacer lets it go now, or NULL. Peers that cannot send are skipped,
+// so one slow receiver does not hold back the others; prev is set to the
+// peer before the one returned.
+static SendPeer* sender_next_peer(Sender* sender, SendPeer** prev) {
+    long now = current_time_usec();
+
+    *prev = NULL;
+    for (SendPeer* peer = sender->ready_head; peer != NULL;
+         peer = peer->ready_next) {
+        if (window_open(sender, peer) &&
+            peer->next_send_usec <= now + PACING_SLACK_USEC) {
+            return peer;
+        }
+        *prev = peer;
+    }
+    return NULL;
+}
+
+// Whether some peer with commands waiting can send a frame now
+static int sender_can_send(Sender* sender) {
+    SendPeer* prev;
+    return sender_next_peer(sender, &prev) != NULL;
+}
+
+// Gap between new frames to a peer: its window spread over the minimum RTT,
+// or half of it in slow start so the pacer never holds back its growth. Only
+// a congestion window below max_cwnd is paced; a full one sends as fast as
+// ACKs come back, like a fixed window.
+static long pacing_interval(Sender* sender, SendPeer* peer) {
+    if (glb_sysconfig.congestion_control != cc_aimd ||
+        sender->min_rtt_usec < 0 || peer->cwnd >= sender->max_cwnd) {
+        return 0;
+    }
+    long interval = sender->min_rtt_usec / peer->cwnd;
+    return peer->cwnd < peer->ssthresh ? interval / 2 : interval;
+}
+
+// Slow start grows the window by a frame per frame acknowledged, in order or
+// not, congestion avoidance by a frame per window
+static void cwnd_grow(Sender* sender, SendPeer* peer, uint32_t acked) {
+    if (glb_sysconfig.congestion_control != cc_aimd) {
+        return;
+    }
+    while (acked-- > 0 && peer->cwnd < sender->max_cwnd) {
+        if (peer->cwnd < peer->ssthresh) {
+            peer->cwnd++;
+        } else if (++peer->cwnd_acked >= peer->cwnd) {
+            peer->cwnd_acked = 0;
+            peer->cwnd++;
         }
+    }
+}
 
-        free(inframe);
-        free(ll_inmsg_node);
+// Whether frames queue up on the way: the smoothed RTT is above the minimum
+// by more than a delayed ACK can hold a frame, plus a quarter for jitter. A
+// loss without that, or before any RTT sample, is taken for random
+// corruption or drop, not congestion.
+static int path_is_queueing(Sender* sender) {
+    if (sender->min_rtt_usec < 0) {
+        return 0;
     }
+    long queueing = sender->srtt_usec - sender->min_rtt_usec;
+    return queueing >
+           glb_sysconfig.ack_delay_usec + sender->min_rtt_usec / 4;
 }
 
-void handle_input_cmds(Sender* sender, LLnode** outgoing_frames_head_ptr) {
-    int input_cmd_length = ll_get_length(sender->input_cmdlist_head);
+// Multiplicative decrease: ssthresh drops to half the unacknowledged frames
+// in flight and the window to ssthresh. Losses from the window that was in flight at the
+// first one only cut it once, and losses while the path is not queueing not
+// at all. Only a timeout that starts a recovery with nothing in flight
+// acknowledged, when the path may have stopped delivering altogether, drops
+// the window to one frame.
+static void cwnd_cut(Sender* sender, SendPeer* peer, int timeout) {
+    if (glb_sysconfig.congestion_control != cc_aimd || peer->in_recovery ||
+        !path_is_queueing(sender)) {
+        return;
+    }
+    uint32_t half = window_pipe(peer) / 2;
+    peer->ssthresh = half > MIN_SSTHRESH ? half : MIN_SSTHRESH;
+    peer->cwnd = peer->ssthresh < sender->max_cwnd ? peer->ssthresh
+                                                   : sender->max_cwnd;
+    if (timeout && peer->sacked == 0) {
+        peer->cwnd = 1;
+    }
+    peer->cwnd_acked = 0;
+    peer->in_recovery = 1;
+    peer->recover = peer->LFS;
+    stats_inc(&sender->stats.cwnd_cuts);
+}
 
-    // Recheck the command queue length to see if stdin_thread dumped a command
-    // on us
-    input_cmd_length = ll_get_length(sender->input_cmdlist_head);
-    while (input_cmd_length > 0) {
+// Nothing queued and nothing in flight. Only meaningful for draining, when
+// no more commands can arrive.
+static int sender_is_idle(Sender* sender) {
+    return sender->pending_cmds == 0 && sender->in_flight == 0;
+}
+
+void sender_request_drain(Sender* sender, Latch* latch) {
+    sender->drain_latch = latch;
+    atomic_store(&sender->draining, 1);
+
+    // Wake the sender in case it is parked with nothing in flight
+    if (glb_sysconfig.lockfree_inbox) {
+        mpsc_waker_wake(&sender->inbox_waker);
+    } else {
+        pthread_mutex_lock(&sender->buffer_mutex);
+        pthread_cond_signal(&sender->buffer_cv);
+        pthread_mutex_unlock(&sender->buffer_mutex);
+    }
+}
+
+// Slide the window past LAR + 1, which must be in flight
+static void window_advance(Sender* sender, SendPeer* peer) {
+    WindowSlot* slot = window_slot(sender, peer, peer->LAR + 1);
+    timer_wheel_cancel(sender->timer_wheel, &slot->timer);
+    // Sliding the window frees the slot; nothing to release
+    if (slot->acked) {
+        peer->sacked--;
+    }
+    slot->acked = 0;
+    peer->LAR++;
+    sender->in_flight--;
+}
+
+// An in-flight frame the receiver reports out of order: stop its timer
+static void slot_sack(Sender* sender, SendPeer* peer, WindowSlot* slot) {
+    if (!slot->acked) {
+        slot->acked = 1;
+        peer->sacked++;
+    }
+    timer_wheel_cancel(sender->timer_wheel, &slot->timer);
+}
+
+// Fold one RTT sample into SRTT/RTTVAR (Jacobson/Karels, RFC 6298) and
+// recompute the RTO. A fresh sample also ends any exponential backoff.
+static void rtt_update(Sender* sender, long sample_usec) {
+    if (sender->srtt_usec < 0) {
+        sender->srtt_usec = sample_usec;
+        sender->rttvar_usec = sample_usec / 2;
+    } else {
+        long error = sender->srtt_usec - sample_usec;
+        if (error < 0) {
+            error = -error;
+        }
+        sender->rttvar_usec += (error - sender->rttvar_usec) / 4;
+        sender->srtt_usec += (sample_usec - sender->srtt_usec) / 8;
+    }
+    if (sender->min_rtt_usec < 0 || sample_usec < sender->min_rtt_usec) {
+        sender->min_rtt_usec = sample_usec;
+    }
 
-        // Pop a node off and update the input_cmd_length
-        LLnode* ll_input_cmd_node = ll_pop_node(&sender->input_cmdlist_head);
-        input_cmd_length = ll_get_length(sender->input_cmdlist_head);
+    long variance = 4 * sender->rttvar_usec;
+    if (variance < RTO_GRANULARITY_USEC) {
+        variance = RTO_GRANULARITY_USEC;
+    }
+    sender->rto_usec = sender->srtt_usec + variance;
+    if (sender->rto_usec < MIN_RTO_USEC) {
+        sender->rto_usec = MIN_RTO_USEC;
+    } else if (sender->rto_usec > MAX_RTO_USEC) {
+        sender->rto_usec = MAX_RTO_USEC;
+    }
+    stats_inc(&sender->stats.rtt_samples);
+    stats_set(&sender->stats.srtt_usec, sender->srtt_usec);
+    stats_set(&sender->stats.rto_usec, sender->rto_usec);
+}
 
-        // Cast to Cmd type and free up the memory for the node
-        Cmd* outgoing_cmd = (Cmd*) ll_input_cmd_node->value;
-        free(ll_input_cmd_node);
-        
-        int msg_length = strlen(outgoing_cmd->message);
+// Exponential backoff after a timeout, once per RTO: only a timer armed
+// with the current RTO doubles it. The other frames of the same window that
+// expire after it were armed with the old one and only re-arm with the new.
+static void rto_backoff(Sender* sender, long timer_rto_usec) {
+    if (timer_rto_usec != sender->rto_usec) {
+        return;
+    }
+    sender->rto_usec *= 2;
+    if (sender->rto_usec > MAX_RTO_USEC) {
+        sender->rto_usec = MAX_RTO_USEC;
+    }
+    stats_set(&sender->stats.rto_usec, sender->rto_usec);
+}
 
-        if (msg_length > FRAME_PAYLOAD_SIZE) {
-            // Parition the message if it is too large
+// Start a retransmission timer one RTO from now and remember that RTO
+static void rto_timer_arm(Sender* sender, TimerEntry* timer,
+                          long* timer_rto_usec, long now) {
+    *timer_rto_usec = sender->rto_usec;
+    timer_wheel_insert(sender->timer_wheel, timer, now + sender->rto_usec);
+}
 
-            int i = 0;
+// Karn's rule: only frames that were never resent give unambiguous samples
+static void rtt_sample_slot(Sender* sender, WindowSlot* slot, long now) {
+    if (!slot->retransmitted) {
+        rtt_update(sender, now - slot->sent_usec);
+    }
+}
 
-            while(msg_length > FRAME_PAYLOAD_SIZE){
-                Frame* outgoing_frame = calloc(1, sizeof(Frame));
-                assert(outgoing_frame);
-                outgoing_frame->msg_len = strlen(outgoing_cmd->message);
-                outgoing_frame->seqNum = ++sender->seqNum;
-                outgoing_frame->flags = msg_length == strlen(outgoing_cmd->message) ? 's' : 'c';  
+// Next retransmission or pacing deadline in usec, or -1 if there is neither.
+// Like sender_next_peer, it only considers peers whose window is open.
+long sender_get_next_deadline(Sender* sender) {
+    long deadline = timer_wheel_next_deadline(sender->timer_wheel);
 
-                outgoing_frame->src_id = outgoing_cmd->src_id;
-                outgoing_frame->dst_id = outgoing_cmd->dst_id;
-                memcpy(outgoing_frame->data, outgoing_cmd->message + i, FRAME_PAYLOAD_SIZE);
+    for (SendPeer* peer = sender->ready_head; peer != NULL;
+         peer = peer->ready_next) {
+        if (!window_open(sender, peer)) {
+            continue;
+        }
+        long pacing = peer->next_send_usec - PACING_SLACK_USEC;
+        if (deadline < 0 || pacing < deadline) {
+            deadline = pacing;
+        }
+    }
+    return deadline;
+}
 
-                // Append frame to buffer
-                ll_append_node(&sender->buffer_framelist_head, outgoing_frame);
+static void resend_slot(Sender* sender, WindowSlot* slot,
+                        LLlist* outgoing_frames) {
+    char* outgoing_charbuf = wire_alloc();
+    frame_encode(&slot->frame, outgoing_charbuf);
+    ll_list_append(outgoing_frames, outgoing_charbuf);
+    slot->retransmitted = 1;
+    stats_inc(&sender->stats.frames_sent);
+    stats_inc(&sender->stats.frames_retransmitted);
+}
 
-                i += FRAME_PAYLOAD_SIZE;
-                msg_length -= FRAME_PAYLOAD_SIZE;
-            }
+// Mark the frames in the ACK's SACK bitmap as received; they are never
+// resent. Returns the window offset (1 for LAR + 1) of the highest one, 0
+// if none is in flight: unacknowledged frames below it are missing.
+static uint32_t sack_apply(Sender* sender, SendPeer* peer, Frame* inframe) {
+    uint32_t length = window_length(peer);
+    uint32_t highest = 0;
+
+    for (uint32_t i = 0; i < (uint32_t) inframe->data_length * 8; i++) {
+        // Whole bytes at a time through the runs of missing frames
+        if (inframe->data[i / 8] == 0) {
+            i |= 7;
+            continue;
+        }
+        if ((inframe->data[i / 8] >> (i % 8) & 1) == 0) {
+            continue;
+        }
+        seq_t seq = inframe->seqNum + 1 + i;
+        if (!seq_in_window(seq, peer->LAR + 1, length)) {
+            continue;
+        }
+        slot_sack(sender, peer, window_slot(sender, peer, seq));
+        if (seq_offset(peer->LAR, seq) > highest) {
+            highest = seq_offset(peer->LAR, seq);
+        }
+    }
+    return highest;
+}
+
+// Resend the frames the receiver is missing without waiting for their
+// timeout: everything unacknowledged below the highest SACKed frame. With no
+// SACK information that is LAR + 1, or the whole window for Go-Back-N. Their
+// timers restart from now.
+static void fast_retransmit(Sender* sender, SendPeer* peer, uint32_t highest,
+                            LLlist* outgoing_frames, long now) {
+    uint32_t end = highest + 1;
+    if (highest == 0) {
+        end = glb_sysconfig.arq_mode == arq_go_back_n ? window_length(peer) + 1
+                                                      : 2;
+    }
+
+    for (uint32_t offset = 1; offset < end; offset++) {
+        WindowSlot* slot = window_slot(sender, peer, peer->LAR + offset);
+        if (slot->acked) {
+            continue;
+        }
+        resend_slot(sender, slot, outgoing_frames);
+        if (glb_sysconfig.arq_mode == arq_selective_repeat) {
+            rto_timer_arm(sender, &slot->timer, &slot->timer_rto_usec, now);
+        }
+    }
+    if (glb_sysconfig.arq_mode == arq_go_back_n) {
+        rto_timer_arm(sender, &peer->timer, &peer->timer_rto_usec, now);
+    }
+    cwnd_cut(sender, peer, 0);
+    stats_inc(&sender->stats.fast_retransmits);
+}
+
+// Duplicate ACKs that trigger fast retransmit. A congestion window smaller
+// than four frames can never produce three, so every loss there would wait
+// for its timeout: count on one per frame sent after the missing one instead.
+static uint32_t dup_ack_threshold(int length) {
+    if (glb_sysconfig.congestion_control == cc_aimd && length > 1 &&
+        length <= FAST_RETRANSMIT_DUP_ACKS) {
+        return length - 1;
+    }
+    return FAST_RETRANSMIT_DUP_ACKS;
+}
+
+// Process one ACK off the wire and release its buffer
+static void handle_ack(Sender* sender, char* raw_char_buf,
+                       LLlist* outgoing_frames, long now) {
+    Frame inframe;
+    frame_decode(raw_char_buf, &inframe);
+
+    // Free raw_char_buf
+    wire_free(raw_char_buf);
+
+    if (inframe.remainder != 0) {
+        stats_inc(&sender->stats.crc_failures);
+        return;
+    }
+
+    // If acknowledgement is for me..
+    SendPeer* peer = NULL;
+    if (inframe.flags == 'a' && inframe.src_id == sender->send_id) {
+        peer = peer_table_get(&sender->peers, inframe.dst_id);
+    }
+    if (peer == NULL) {
+        stats_inc(&sender->stats.frames_ignored);
+        return;
+    }
+    stats_inc(&sender->stats.acks_received);
+    int selective = glb_sysconfig.arq_mode == arq_selective_repeat;
+    int length = window_length(peer);
+    uint32_t pipe = window_pipe(peer);
+    seq_t trigger_seq = (seq_t) inframe.msg_len;
+
+    // RTT sample from the frame that triggered this ACK
+    if (seq_in_window(trigger_seq, peer->LAR + 1, length)) {
+        WindowSlot* slot = window_slot(sender, peer, trigger_seq);
+        if (!slot->acked) {
+            rtt_sample_slot(sender, slot, now);
+        }
+
+        // Selective Repeat: that frame is known to have arrived
+        if (selective) {
+            slot_sack(sender, peer, slot);
+        }
+    }
 
-            // Send the last packet
-            Frame* outgoing_frame = calloc(1, sizeof(Frame));
-            assert(outgoing_frame);
-            outgoing_frame->seqNum =  ++sender->seqNum;        
-            outgoing_frame->flags = 'f';   
-            outgoing_frame->src_id = outgoing_cmd->src_id;
-            outgoing_frame->dst_id = outgoing_cmd->dst_id;
-            memcpy(outgoing_frame->data, outgoing_cmd->message + i, msg_length);
+    // Cumulative ACK: everything up to seqNum arrived, slide past it
+    if (seq_lt(peer->LAR, inframe.seqNum) && seq_le(inframe.seqNum, peer->LFS)) {
+        while (peer->LAR != inframe.seqNum) {
+            window_advance(sender, peer);
+        }
+    }
 
-            // At this point, we don't need the outgoing_cmd
-            free(outgoing_cmd->message);
-            free(outgoing_cmd);
+    uint32_t highest = sack_apply(sender, peer, &inframe);
 
-            // Append frame to buffer
-            ll_append_node(&sender->buffer_framelist_head, outgoing_frame);
+    // Selective Repeat: also slide over frames acknowledged out of order
+    while (selective && window_length(peer) > 0 &&
+           window_slot(sender, peer, peer->LAR + 1)->acked) {
+        window_advance(sender, peer);
+    }
 
+    // Recovery ends once everything in flight at the loss is acknowledged
+    if (peer->in_recovery && seq_le(peer->recover, peer->LAR)) {
+        peer->in_recovery = 0;
+    }
+    cwnd_grow(sender, peer, pipe - window_pipe(peer));
 
+    // The third ACK in a row stuck at the same frame means it was lost
+    if (window_length(peer) == length) {
+        stats_inc(&sender->stats.acks_duplicate);
+        if (length > 0 && ++peer->dup_acks == dup_ack_threshold(length)) {
+            fast_retransmit(sender, peer, highest, outgoing_frames, now);
+        }
+    } else {
+        peer->dup_acks = 0;
+    }
+
+    // Go-Back-N: restart the timer for the new oldest frame, if any
+    if (!selective && window_length(peer) != length) {
+        if (window_length(peer) > 0) {
+            rto_timer_arm(sender, &peer->timer, &peer->timer_rto_usec, now);
         } else {
-            // Queue packets
-            // This is probably ONLY one step you want
-            Frame* outgoing_frame = calloc(1, sizeof(Frame));
-            assert(outgoing_frame);
-            outgoing_frame->seqNum =  ++sender->seqNum;         
-            outgoing_frame->flags = 'd';   
-            outgoing_frame->src_id = outgoing_cmd->src_id;
-            outgoing_frame->dst_id = outgoing_cmd->dst_id;
-            strcpy(outgoing_frame->data, outgoing_cmd->message);
-
-            // At this point, we don't need the outgoing_cmd
-            free(outgoing_cmd->message);
-            free(outgoing_cmd);
-
-            // Append frame to buffer
-            ll_append_node(&sender->buffer_framelist_head, outgoing_frame);
+            timer_wheel_cancel(sender->timer_wheel, &peer->timer);
+        }
+    }
+}
+
+// Runs without buffer_mutex: incoming_msgs_head was already spliced out of
+// the inbox (and is NULL with the lock-free inboxes, which we drain here)
+void handle_incoming_acks(Sender* sender, LLnode* incoming_msgs_head,
+                          LLlist* outgoing_frames) {
+    long now = current_time_usec();
+    unsigned long batch = 0;
+    char* raw_char_buf;
 
+    // If I received a msg from a receiver...
+    if (glb_sysconfig.lockfree_inbox) {
+        while ((raw_char_buf = mpsc_pop(&sender->frame_inbox)) != NULL) {
+            handle_ack(sender, raw_char_buf, outgoing_frames, now);
+            batch++;
+        }
+    } else {
+        LLnode* ll_inmsg_node;
+        while ((ll_inmsg_node = ll_pop_node(&incoming_msgs_head)) != NULL) {
+            handle_ack(sender, ll_inmsg_node->value, outgoing_frames, now);
+            ll_free_node(ll_inmsg_node);
+            batch++;
         }
     }
+    stats_max(&sender->stats.max_inbox_batch, batch);
+}
 
-    // Send a packet
-    int buffered_frames_length = ll_get_length(sender->buffer_framelist_head);
-    if (buffered_frames_length > 0 && sender->LFS - sender->LAR <= sender->SWS) {
-        LLnode* ll_frame_node = ll_pop_node(&sender->buffer_framelist_head);
-        Frame* outgoing_frame = (Frame*) ll_frame_node->value;
+static void queue_cmd(Sender* sender, Cmd* outgoing_cmd) {
+    SendPeer* peer = sender_peer(sender, outgoing_cmd->dst_id);
 
-        sender->LFS = outgoing_frame->seqNum;
+    outgoing_cmd->msg_id = sender->packet_id++;
+    outgoing_cmd->offset = 0;
+    if (peer->pending_cmds.length == 0) {
+        ready_append(sender, peer);
+    }
+    ll_list_append(&peer->pending_cmds, outgoing_cmd);
+    sender->pending_cmds++;
+}
+
+// Bytes [offset, offset + length) of the message: the head from message,
+// the rest from the file's current chunk
+static void cmd_read(Cmd* cmd, uint32_t offset, uint32_t length, char* out) {
+    uint32_t head_length = cmd->file ? cmd->head_length : cmd->length;
+    if (offset < head_length) {
+        uint32_t from_head = head_length - offset;
+        if (from_head > length) {
+            from_head = length;
+        }
+        memcpy(out, cmd->message + offset, from_head);
+        out += from_head;
+        offset += from_head;
+        length -= from_head;
+    }
+    memcpy(out, cmd->map + cmd->chunk_start + (offset - head_length), length);
+}
 
-        free(ll_frame_node);
-    
-        // Append the frame to the window buffer
-        ll_append_node(&sender->window_buffer_head, outgoing_frame);
+// Cut the next frame of the peer's head command straight into its window
+// slot. Each frame names its message and the byte offset of its fragment,
+// so the receiver can copy it straight into place. A command is only cut up
+// as its frames go out, so a file is never in memory as a whole.
+static void frame_next_fragment(Sender* sender, SendPeer* prev,
+                                SendPeer* peer, Frame* outgoing_frame) {
+    Cmd* outgoing_cmd = peer->pending_cmds.head->value;
+
+    outgoing_frame->flags = outgoing_cmd->file ? 'f' : 'd';
+    outgoing_frame->seqNum = peer->LFS;
+    outgoing_frame->src_id = outgoing_cmd->src_id;
+    outgoing_frame->dst_id = outgoing_cmd->dst_id;
+    outgoing_frame->msg_len = outgoing_cmd->length;
+    outgoing_frame->offset = outgoing_cmd->offset;
+    outgoing_frame->msg_id = outgoing_cmd->msg_id;
+
+    // The header decides how much data fits in the rest of the frame
+    uint32_t fragment = outgoing_cmd->length - outgoing_cmd->offset;
+    uint32_t capacity = frame_capacity(outgoing_frame);
+    if (fragment > capacity) {
+        fragment = capacity;
+    }
+    outgoing_frame->data_length = fragment;
+    cmd_read(outgoing_cmd, outgoing_cmd->offset, fragment, outgoing_frame->data);
+    outgoing_cmd->offset += fragment;
+
+    // An empty message still takes one frame. The next chunk of a file
+    // follows as a message of its own; at this point, we don't need the
+    // outgoing_cmd.
+    if (outgoing_cmd->offset == outgoing_cmd->length &&
+        cmd_next_chunk(outgoing_cmd)) {
+        outgoing_cmd->msg_id = sender->packet_id++;
+        outgoing_cmd->offset = 0;
+    } else if (outgoing_cmd->offset == outgoing_cmd->length) {
+        LLnode* ll_cmd_node = ll_list_pop(&peer->pending_cmds);
+        ll_free_node(ll_cmd_node);
+        cmd_free(outgoing_cmd);
+        sender->pending_cmds--;
+    }
 
-        // Convert the message to the outgoing_charbuf
-        char* outgoing_charbuf = convert_frame_to_char(outgoing_frame);
-        ll_append_node(outgoing_frames_head_ptr, outgoing_charbuf);
+    // Round-robin: the peer goes to the back of the ready list, or leaves it
+    // once it has nothing more to send
+    ready_unlink(sender, prev, peer);
+    if (peer->pending_cmds.length > 0) {
+        ready_append(sender, peer);
     }
 }
 
+// Cut the next frame for peer into its window slot and send it
+static void send_next_frame(Sender* sender, SendPeer* prev, SendPeer* peer,
+                            LLlist* outgoing_frames) {
+    peer->LFS++;
+    sender->in_flight++;
+
+    WindowSlot* slot = window_slot(sender, peer, peer->LFS);
+    Frame* outgoing_frame = &slot->frame;
+    frame_next_fragment(sender, prev, peer, outgoing_frame);
+
+    long now = current_time_usec();
+    slot->sent_usec = now;
+    slot->retransmitted = 0;
+    slot->acked = 0;
+
+    // Space the next frame from when this one was due, so wakeup latency
+    // does not lower the rate
+    long due = peer->next_send_usec > now ? peer->next_send_usec : now;
+    peer->next_send_usec = due + pacing_interval(sender, peer);
+
+    if (glb_sysconfig.arq_mode == arq_selective_repeat) {
+        // Selective Repeat: start this frame's own retransmission timer
+        rto_timer_arm(sender, &slot->timer, &slot->timer_rto_usec, now);
+    } else if (!peer->timer.armed) {
+        // Go-Back-N: the timer tracks the oldest frame in flight
+        rto_timer_arm(sender, &peer->timer, &peer->timer_rto_usec, now);
+    }
 
-void handle_timedout_frames(Sender* sender, LLnode** outgoing_frames_head_ptr) {
-    struct timeval current_time;
-    gettimeofday(&current_time, NULL);
+    // Encode the frame into a pooled wire buffer
+    char* outgoing_charbuf = wire_alloc();
+    frame_encode(outgoing_frame, outgoing_charbuf);
+    ll_list_append(outgoing_frames, outgoing_charbuf);
 
-    // printf("length is %d\n", ll_get_length(sender->window_buffer_head));
+    stats_inc(&sender->stats.frames_sent);
+    stats_add(&sender->stats.window_occupancy_sum, window_length(peer));
+    stats_max(&sender->stats.max_in_flight, sender->in_flight);
+}
 
-    // If there is a buffered message & we timed-out waiting for ACK
-    if ((sender->timeout_timeval != NULL) && (timeval_usecdiff(&current_time, sender->timeout_timeval) <= 0)) {
-        // Resend all packets in window
-        int count = 0;
-        for(int i = sender->LAR; i < sender->LFS; i++){
-            LLnode* ll_frame_node = ll_get_node(&sender->window_buffer_head, count);
-            Frame* outgoing_frame = (Frame*) ll_frame_node->value;
+// Like handle_incoming_acks, input_cmds_head is already out of the inbox
+void handle_input_cmds(Sender* sender, LLnode* input_cmds_head,
+                       LLlist* outgoing_frames) {
+    Cmd* outgoing_cmd;
 
-            // printf("attempting retransmit of %d\n", outgoing_frame->seqNum);
-            char* outgoing_charbuf = convert_frame_to_char(outgoing_frame);
-            ll_append_node(outgoing_frames_head_ptr, outgoing_charbuf);
-            count++;
+    if (glb_sysconfig.lockfree_inbox) {
+        while ((outgoing_cmd = mpsc_pop(&sender->cmd_inbox)) != NULL) {
+            queue_cmd(sender, outgoing_cmd);
+        }
+    } else {
+        LLnode* ll_input_cmd_node;
+
+        while ((ll_input_cmd_node = ll_pop_node(&input_cmds_head)) != NULL) {
+            // Cast to Cmd type and free up the memory for the node
+            outgoing_cmd = (Cmd*) ll_input_cmd_node->value;
+            ll_free_node(ll_input_cmd_node);
+            queue_cmd(sender, outgoing_cmd);
         }
     }
+    stats_max(&sender->stats.max_buffered, sender->pending_cmds);
+
+    // Send every frame the windows and the pacers allow, taking the peers in
+    // turn
+    SendPeer* prev;
+    SendPeer* peer;
+    while ((peer = sender_next_peer(sender, &prev)) != NULL) {
+        send_next_frame(sender, prev, peer, outgoing_frames);
+    }
+}
+
+// State handed to the timer expiry callbacks
+struct SenderExpiry_t {
+    Sender* sender;
+    LLlist* outgoing_frames;
+    long now;
+};
+
+// Selective Repeat: resend the single frame whose timer fired and re-arm it
+static void sr_frame_timedout(TimerEntry* timer, void* arg) {
+    struct SenderExpiry_t* expiry = arg;
+    WindowSlot* slot = container_of(timer, WindowSlot, timer);
+
+    stats_inc(&expiry->sender->stats.timeouts);
+    rto_backoff(expiry->sender, slot->timer_rto_usec);
+    resend_slot(expiry->sender, slot, expiry->outgoing_frames);
+    cwnd_cut(expiry->sender,
+             peer_table_get(&expiry->sender->peers, slot->frame.dst_id), 1);
+    rto_timer_arm(expiry->sender, timer, &slot->timer_rto_usec, expiry->now);
+}
+
+// Go-Back-N: we timed-out waiting for ACK, resend all packets in the window
+// the receiver has not SACKed
+static void gbn_window_timedout(TimerEntry* timer, void* arg) {
+    struct SenderExpiry_t* expiry = arg;
+    Sender* sender = expiry->sender;
+    SendPeer* peer = container_of(timer, SendPeer, timer);
+
+    stats_inc(&sender->stats.timeouts);
+    rto_backoff(sender, peer->timer_rto_usec);
+    cwnd_cut(sender, peer, 1);
+    int length = window_length(peer);
+    for (int count = 0; count < length; count++) {
+        WindowSlot* slot = window_slot(sender, peer, peer->LAR + 1 + count);
+        if (!slot->acked) {
+            resend_slot(sender, slot, expiry->outgoing_frames);
+        }
+    }
+    rto_timer_arm(sender, timer, &peer->timer_rto_usec, expiry->now);
+}
+
+void handle_timedout_frames(Sender* sender, LLlist* outgoing_frames) {
+    long now = current_time_usec();
+    long deadline = timer_wheel_next_deadline(sender->timer_wheel);
+
+    if (deadline < 0 || deadline > now) {
+        return;
+    }
+
+    struct SenderExpiry_t expiry = { sender, outgoing_frames, now };
+    timer_wheel_expire(sender->timer_wheel, now,
+                       glb_sysconfig.arq_mode == arq_selective_repeat
+                           ? sr_frame_timedout
+                           : gbn_window_timedout,
+                       &expiry);
 }
 
 void* run_sender(void* input_sender) {
@@ -205,8 +783,8 @@ void* run_sender(void* input_sender) {
     const int WAIT_SEC_TIME = 0;
     const long WAIT_USEC_TIME = 100000;
     Sender* sender = (Sender*) input_sender;
-    LLnode* outgoing_frames_head;
-    struct timeval* expiring_timeval;
+    LLlist outgoing_frames;
+    LLnode* ll_outframe_node;
     long sleep_usec_time, sleep_sec_time;
 
     // This incomplete sender thread, at a high level, loops as follows:
@@ -218,7 +796,11 @@ void* run_sender(void* input_sender) {
     // 5. Sends out the messages
 
     while (1) {
-        outgoing_frames_head = NULL;
+        ll_list_init(&outgoing_frames);
+
+        // Everything queued before the drain request is in the inboxes by
+        // now, so this iteration picks all of it up
+        int draining = atomic_load(&sender->draining);
 
         // Get the current time
         gettimeofday(&curr_timeval, NULL);
@@ -229,26 +811,21 @@ void* run_sender(void* input_sender) {
         time_spec.tv_sec = curr_timeval.tv_sec;
         time_spec.tv_nsec = curr_timeval.tv_usec * 1000;
 
-        // Check for the next event we should handle
-        expiring_timeval = sender_get_next_expiring_timeval(sender);
-        if (sender->timeout_timeval != NULL) free(sender->timeout_timeval);
-        sender->timeout_timeval = expiring_timeval;
-
-        // Perform full on timeout
-        if (expiring_timeval == NULL) {
-            time_spec.tv_sec += WAIT_SEC_TIME;
-            time_spec.tv_nsec += WAIT_USEC_TIME * 1000;
-        } else {
+        // Check for the next event we should handle; with nothing in flight
+        // perform a full timeout
+        long deadline = sender_get_next_deadline(sender);
+        sleep_usec_time = WAIT_SEC_TIME * 1000000L + WAIT_USEC_TIME;
+        if (deadline >= 0) {
             // Take the difference between the next event and the current time
-            sleep_usec_time = timeval_usecdiff(&curr_timeval, expiring_timeval);
-
-            // Sleep if the difference is positive
-            if (sleep_usec_time > 0) {
-                sleep_sec_time = sleep_usec_time / 1000000;
-                sleep_usec_time = sleep_usec_time % 1000000;
-                time_spec.tv_sec += sleep_sec_time;
-                time_spec.tv_nsec += sleep_usec_time * 1000;
-            }
+            sleep_usec_time = deadline - current_time_usec();
+        }
+
+        // Sleep if the difference is positive
+        if (sleep_usec_time > 0) {
+            sleep_sec_time = sleep_usec_time / 1000000;
+            sleep_usec_time = sleep_usec_time % 1000000;
+            time_spec.tv_sec += sleep_sec_time;
+            time_spec.tv_nsec += sleep_usec_time * 1000;
         }
 
         // Check to make sure we didn't "overflow" the nanosecond field
@@ -263,36 +840,60 @@ void* run_sender(void* input_sender) {
         //      between the mutex lock and unlock, because other threads
         //      CAN/WILL access these structures
         //*****************************************************************************************
-        pthread_mutex_lock(&sender->buffer_mutex);
-
-        // Check whether anything has arrived
-        int input_cmd_length = ll_get_length(sender->input_cmdlist_head);
-        int inframe_queue_length = ll_get_length(sender->input_framelist_head);
+        LLnode* input_cmds_head = NULL;
+        LLnode* incoming_msgs_head = NULL;
+        if (glb_sysconfig.lockfree_inbox) {
+            // Lock-free inboxes: park on the eventfd instead of the condvar
+            int drained = atomic_load(&sender->draining) && sender_is_idle(sender);
+            MpscQueue* inboxes[] = { &sender->cmd_inbox, &sender->frame_inbox };
+            if (sender_can_send(sender) || drained) {
+                // Keep going
+            } else if (glb_sysconfig.epoll_backend) {
+                // No deadline means nothing in flight: sleep until pushed to
+                event_loop_wait(&sender->event_loop, &sender->inbox_waker,
+                                inboxes, 2, deadline);
+            } else {
+                mpsc_waker_wait(&sender->inbox_waker, inboxes, 2, &time_spec);
+            }
+        } else {
+            pthread_mutex_lock(&sender->buffer_mutex);
+
+            // Nothing (cmd nor incoming frame) has arrived, so do a timed
+            // wait on the sender's condition variable (releases lock) A
+            // signal on the condition variable will wakeup the thread and
+            // reaquire the lock. Keep going while the window has room for a
+            // buffered frame
+            int inbox_empty = sender->input_cmdlist_head == NULL && sender->input_framelist_head == NULL;
+            int drained = atomic_load(&sender->draining) && sender_is_idle(sender);
+            if (inbox_empty && !sender_can_send(sender) && !drained) {
+                pthread_cond_timedwait(&sender->buffer_cv, &sender->buffer_mutex,
+                                       &time_spec);
+            }
 
-        // Nothing (cmd nor incoming frame) has arrived, so do a timed wait on
-        // the sender's condition variable (releases lock) A signal on the
-        // condition variable will wakeup the thread and reaquire the lock
-        if ((input_cmd_length == 0 && inframe_queue_length == 0) || sender->timeout_timeval != NULL) {
-            pthread_cond_timedwait(&sender->buffer_cv, &sender->buffer_mutex,
-                                   &time_spec);
+            // Only swap the inboxes out under the lock; decoding, window
+            // updates and fragmentation all happen after producers are
+            // let back in
+            long hold_start = monotonic_time_nsec();
+            input_cmds_head = ll_splice(&sender->input_cmdlist_head);
+            incoming_msgs_head = ll_splice(&sender->input_framelist_head);
+            pthread_mutex_unlock(&sender->buffer_mutex);
+            stats_add(&sender->stats.lock_hold_nsec,
+                      monotonic_time_nsec() - hold_start);
+            stats_inc(&sender->stats.lock_holds);
         }
-        // Implement this
-        handle_incoming_acks(sender, &outgoing_frames_head);
 
         // Implement this
-        handle_input_cmds(sender, &outgoing_frames_head);
+        handle_incoming_acks(sender, incoming_msgs_head, &outgoing_frames);
 
-        pthread_mutex_unlock(&sender->buffer_mutex);
+        // Implement this
+        handle_input_cmds(sender, input_cmds_head, &outgoing_frames);
 
         // Implement this
-        handle_timedout_frames(sender, &outgoing_frames_head);
+        handle_timedout_frames(sender, &outgoing_frames);
 
         // CHANGE THIS AT YOUR OWN RISK!
         // Send out all the frames
-        int ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
-
-        while (ll_outgoing_frame_length > 0) {
-            LLnode* ll_outframe_node = ll_pop_node(&outgoing_frames_head);
+        while ((ll_outframe_node = ll_list_pop(&outgoing_frames)) != NULL) {
             char* char_buf = (char*) ll_outframe_node->value;
 
             // Frame* inframe = convert_char_to_frame(char_buf);
@@ -303,11 +904,45 @@ void* run_sender(void* input_sender) {
             send_msg_to_receivers(char_buf);
 
             // Free up the ll_outframe_node
-            free(ll_outframe_node);
+            ll_free_node(ll_outframe_node);
+        }
 
-            ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
+        // Drained: everything we were given has been acknowledged
+        if (draining && sender_is_idle(sender)) {
+            latch_count_down(sender->drain_latch);
+            break;
         }
     }
     pthread_exit(NULL);
     return 0;
 }
+
+// The pool does the waiting: process whatever is queued, then yield while
+// the window still has room or park until the next retransmission or pacing
+// deadline
+void run_sender_task(Task* task) {
+    Sender* sender = container_of(task, Sender, task);
+    LLlist outgoing_frames;
+    LLnode* ll_outframe_node;
+
+    ll_list_init(&outgoing_frames);
+    int draining = atomic_load(&sender->draining);
+
+    handle_incoming_acks(sender, NULL, &outgoing_frames);
+    handle_input_cmds(sender, NULL, &outgoing_frames);
+    handle_timedout_frames(sender, &outgoing_frames);
+
+    while ((ll_outframe_node = ll_list_pop(&outgoing_frames)) != NULL) {
+        send_msg_to_receivers(ll_outframe_node->value);
+        ll_free_node(ll_outframe_node);
+    }
+
+    if (draining && sender_is_idle(sender)) {
+        // Done for good: the task is never queued again
+        latch_count_down(sender->drain_latch);
+    } else if (sender_can_send(sender)) {
+        task_yield(task);
+    } else {
+        task_park(task, sender_get_next_deadline(sender));
+    }
+}
@@ -17,6 +17,12 @@
 #include <unistd.h>
 
 void init_sender(Sender*, int);
+void destroy_sender(Sender*);
+// Call once no more commands will arrive; the sender counts latch down when
+// it has flushed everything and then exits
+void sender_request_drain(Sender*, Latch*);
 void* run_sender(void*);
+// One round of run_sender for the worker pool (-w)
+void run_sender_task(Task*);
 
 #endif
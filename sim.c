@@ -0,0 +1,108 @@
+#include "sim.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SIM_INITIAL_CAPACITY 1024
+
+// Binary min-heap of pending events
+static SimEvent* sim_events;
+static int sim_events_length;
+static int sim_events_capacity;
+static unsigned long sim_next_order;
+static unsigned long sim_fired;
+static long sim_clock;
+static uint64_t sim_rng_state;
+
+static inline int sim_event_before(SimEvent* a, SimEvent* b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+void sim_init(uint64_t seed) {
+    sim_events = malloc(SIM_INITIAL_CAPACITY * sizeof(SimEvent));
+    assert(sim_events);
+    sim_events_length = 0;
+    sim_events_capacity = SIM_INITIAL_CAPACITY;
+    sim_next_order = 0;
+    sim_fired = 0;
+    sim_clock = 0;
+    // xorshift must not start from zero
+    sim_rng_state = seed ? seed : 0x9E3779B97F4A7C15ull;
+}
+
+void sim_destroy(void) { free(sim_events); }
+
+long sim_now(void) { return sim_clock; }
+
+void sim_at(long time_usec, void (*fire)(void*, void*), void* target,
+            void* value) {
+    if (sim_events_length == sim_events_capacity) {
+        sim_events_capacity *= 2;
+        sim_events = realloc(sim_events, sim_events_capacity * sizeof(SimEvent));
+        assert(sim_events);
+    }
+
+    // The clock never runs backwards
+    SimEvent event = { time_usec < sim_clock ? sim_clock : time_usec,
+                       sim_next_order++, fire, target, value };
+    int i = sim_events_length++;
+    while (i > 0 && sim_event_before(&event, &sim_events[(i - 1) / 2])) {
+        sim_events[i] = sim_events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim_events[i] = event;
+}
+
+static SimEvent sim_pop(void) {
+    SimEvent first = sim_events[0];
+    SimEvent last = sim_events[--sim_events_length];
+    int i = 0;
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= sim_events_length) {
+            break;
+        }
+        if (child + 1 < sim_events_length &&
+            sim_event_before(&sim_events[child + 1], &sim_events[child])) {
+            child++;
+        }
+        if (!sim_event_before(&sim_events[child], &last)) {
+            break;
+        }
+        sim_events[i] = sim_events[child];
+        i = child;
+    }
+    sim_events[i] = last;
+    return first;
+}
+
+unsigned long sim_run(void) {
+    while (sim_events_length > 0) {
+        SimEvent event = sim_pop();
+        sim_clock = event.time;
+        event.fire(event.target, event.value);
+        sim_fired++;
+    }
+    return sim_fired;
+}
+
+void sim_run_until(long time_usec) {
+    while (sim_events_length > 0 && sim_events[0].time <= time_usec) {
+        SimEvent event = sim_pop();
+        sim_clock = event.time;
+        event.fire(event.target, event.value);
+        sim_fired++;
+    }
+    if (time_usec > sim_clock) {
+        sim_clock = time_usec;
+    }
+}
+
+int sim_rand(void) {
+    // xorshift64*
+    sim_rng_state ^= sim_rng_state >> 12;
+    sim_rng_state ^= sim_rng_state << 25;
+    sim_rng_state ^= sim_rng_state >> 27;
+    return (int) ((sim_rng_state * 0x2545F4914F6CDD1Dull) >> 33);
+}
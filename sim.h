@@ -0,0 +1,42 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+// Deterministic discrete-event engine (--simulate). A single thread fires
+// events in (time, insertion) order and the virtual clock jumps straight to
+// each one, so timeouts cost no wall time and a run depends only on its
+// input and seed.
+struct SimEvent_t {
+    long time;
+    unsigned long order;
+    void (*fire)(void* target, void* value);
+    void* target;
+    void* value;
+};
+typedef struct SimEvent_t SimEvent;
+
+// One-way delay of every simulated link
+#define SIM_LINK_DELAY_USEC 1000
+
+void sim_init(uint64_t seed);
+void sim_destroy(void);
+
+// Virtual time in usec, starting at 0; current_time_usec() in simulation
+long sim_now(void);
+
+// Call fire(target, value) once the clock reaches time_usec
+void sim_at(long time_usec, void (*fire)(void*, void*), void* target,
+            void* value);
+
+// Fire events until none are left; returns how many fired since sim_init
+unsigned long sim_run(void);
+
+// Fire the events due by time_usec, then move the clock there (a script
+// waiting on the virtual clock)
+void sim_run_until(long time_usec);
+
+// Seeded stand-in for rand(): 0 .. 2^31 - 1
+int sim_rand(void);
+
+#endif
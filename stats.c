@@ -0,0 +1,162 @@
+// sigwait and pthread_sigmask are POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include "common.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+
+// Add one endpoint's inbox lock holds to the totals, and track the largest
+// average hold of any endpoint
+static void stats_lock_holds(unsigned long* total_nsec,
+                             unsigned long* total_holds,
+                             unsigned long* avg_max,
+                             const atomic_ulong* hold_nsec_counter,
+                             const atomic_ulong* holds_counter) {
+    unsigned long hold_nsec = stats_read(hold_nsec_counter);
+    unsigned long holds = stats_read(holds_counter);
+    *total_nsec += hold_nsec;
+    *total_holds += holds;
+    if (holds > 0 && hold_nsec / holds > *avg_max) {
+        *avg_max = hold_nsec / holds;
+    }
+}
+
+// Add one counter of an endpoint into the total
+static inline void stats_sum(atomic_ulong* total, const atomic_ulong* counter) {
+    stats_add(total, stats_read(counter));
+}
+
+static inline void stats_max_of(atomic_ulong* max, const atomic_ulong* counter) {
+    stats_max(max, stats_read(counter));
+}
+
+void stats_print(FILE* out) {
+    SenderStats send = { 0 };
+    ReceiverStats recv = { 0 };
+    // RTO estimates of the senders with an RTT sample, and inbox lock holds
+    // of every endpoint
+    unsigned long srtt_sum = 0, srtt_max = 0, rto_sum = 0, rto_max = 0;
+    unsigned long rtt_sampled = 0;
+    unsigned long hold_nsec = 0, holds = 0, hold_avg_max = 0;
+    int i;
+
+    for (i = 0; i < glb_senders_array_length; i++) {
+        SenderStats* stats = &glb_senders_array[i].stats;
+        stats_sum(&send.frames_sent, &stats->frames_sent);
+        stats_sum(&send.frames_retransmitted, &stats->frames_retransmitted);
+        stats_sum(&send.timeouts, &stats->timeouts);
+        stats_sum(&send.fast_retransmits, &stats->fast_retransmits);
+        stats_sum(&send.cwnd_cuts, &stats->cwnd_cuts);
+        stats_sum(&send.acks_received, &stats->acks_received);
+        stats_sum(&send.acks_duplicate, &stats->acks_duplicate);
+        stats_sum(&send.crc_failures, &stats->crc_failures);
+        stats_sum(&send.frames_ignored, &stats->frames_ignored);
+        stats_sum(&send.link.dropped, &stats->link.dropped);
+        stats_sum(&send.link.corrupted, &stats->link.corrupted);
+        stats_sum(&send.window_occupancy_sum, &stats->window_occupancy_sum);
+        stats_max_of(&send.max_in_flight, &stats->max_in_flight);
+        stats_max_of(&send.max_buffered, &stats->max_buffered);
+        stats_max_of(&send.max_inbox_batch, &stats->max_inbox_batch);
+
+        if (stats_read(&stats->rtt_samples) > 0) {
+            unsigned long srtt = stats_read(&stats->srtt_usec);
+            unsigned long rto = stats_read(&stats->rto_usec);
+            rtt_sampled++;
+            srtt_sum += srtt;
+            srtt_max = srtt > srtt_max ? srtt : srtt_max;
+            rto_sum += rto;
+            rto_max = rto > rto_max ? rto : rto_max;
+        }
+        stats_lock_holds(&hold_nsec, &holds, &hold_avg_max,
+                         &stats->lock_hold_nsec, &stats->lock_holds);
+    }
+    for (i = 0; i < glb_receivers_array_length; i++) {
+        ReceiverStats* stats = &glb_receivers_array[i].stats;
+        stats_sum(&recv.frames_received, &stats->frames_received);
+        stats_sum(&recv.crc_failures, &stats->crc_failures);
+        stats_sum(&recv.frames_ignored, &stats->frames_ignored);
+        stats_sum(&recv.duplicates, &stats->duplicates);
+        stats_sum(&recv.out_of_order, &stats->out_of_order);
+        stats_sum(&recv.out_of_window, &stats->out_of_window);
+        stats_sum(&recv.messages_delivered, &stats->messages_delivered);
+        stats_sum(&recv.acks_sent, &stats->acks_sent);
+        stats_sum(&recv.acks_delayed, &stats->acks_delayed);
+        stats_sum(&recv.link.dropped, &stats->link.dropped);
+        stats_sum(&recv.link.corrupted, &stats->link.corrupted);
+        stats_max_of(&recv.max_inbox_batch, &stats->max_inbox_batch);
+
+        stats_lock_holds(&hold_nsec, &holds, &hold_avg_max,
+                         &stats->lock_hold_nsec, &stats->lock_holds);
+    }
+
+    // Average window length right after each first transmission
+    unsigned long first_sends =
+        stats_read(&send.frames_sent) - stats_read(&send.frames_retransmitted);
+    double avg_window =
+        first_sends ? (double) stats_read(&send.window_occupancy_sum) / first_sends
+                    : 0;
+
+    fprintf(out,
+            "Senders: frames_sent=%lu retransmitted=%lu timeouts=%lu "
+            "fast_retransmits=%lu cwnd_cuts=%lu acks=%lu dup_acks=%lu "
+            "crc_failures=%lu ignored=%lu link_dropped=%lu "
+            "link_corrupted=%lu avg_window=%.2f max_in_flight=%lu "
+            "max_buffered=%lu max_inbox_batch=%lu avg_srtt=%luus "
+            "max_srtt=%luus avg_rto=%luus max_rto=%luus\n",
+            stats_read(&send.frames_sent), stats_read(&send.frames_retransmitted),
+            stats_read(&send.timeouts), stats_read(&send.fast_retransmits),
+            stats_read(&send.cwnd_cuts), stats_read(&send.acks_received),
+            stats_read(&send.acks_duplicate), stats_read(&send.crc_failures),
+            stats_read(&send.frames_ignored), stats_read(&send.link.dropped),
+            stats_read(&send.link.corrupted), avg_window,
+            stats_read(&send.max_in_flight), stats_read(&send.max_buffered),
+            stats_read(&send.max_inbox_batch),
+            rtt_sampled ? srtt_sum / rtt_sampled : 0, srtt_max,
+            rtt_sampled ? rto_sum / rtt_sampled : 0, rto_max);
+    fprintf(out,
+            "Receivers: frames_received=%lu crc_failures=%lu ignored=%lu "
+            "duplicates=%lu out_of_order=%lu out_of_window=%lu "
+            "delivered=%lu acks_sent=%lu acks_delayed=%lu "
+            "link_dropped=%lu link_corrupted=%lu max_inbox_batch=%lu\n",
+            stats_read(&recv.frames_received), stats_read(&recv.crc_failures),
+            stats_read(&recv.frames_ignored), stats_read(&recv.duplicates),
+            stats_read(&recv.out_of_order), stats_read(&recv.out_of_window),
+            stats_read(&recv.messages_delivered), stats_read(&recv.acks_sent),
+            stats_read(&recv.acks_delayed), stats_read(&recv.link.dropped),
+            stats_read(&recv.link.corrupted), stats_read(&recv.max_inbox_batch));
+    // Lock-free inboxes take no lock
+    if (!glb_sysconfig.lockfree_inbox) {
+        fprintf(out,
+                "Inbox locks: holds=%lu avg_hold=%luns "
+                "max_endpoint_avg_hold=%luns\n",
+                holds, holds ? hold_nsec / holds : 0, hold_avg_max);
+    }
+    fflush(out);
+}
+
+static void* run_stats_signal(void* arg) {
+    sigset_t* set = arg;
+    int signal;
+
+    while (sigwait(set, &signal) == 0) {
+        stats_print(stderr);
+    }
+    return NULL;
+}
+
+void stats_start_signal_thread(void) {
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    int rc = pthread_create(&thread, NULL, run_stats_signal, &set);
+    assert(rc == 0);
+    (void) rc;
+    pthread_detach(thread);
+}
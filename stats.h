@@ -0,0 +1,45 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// The counters in SenderStats and ReceiverStats have one writer, their
+// endpoint, and are read from other threads by the stats printers. Relaxed
+// atomics make that race-free; with a single writer an increment needs no
+// read-modify-write, so it costs what a plain one does.
+static inline unsigned long stats_read(const atomic_ulong* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline void stats_add(atomic_ulong* counter, unsigned long value) {
+    atomic_store_explicit(counter, stats_read(counter) + value,
+                          memory_order_relaxed);
+}
+
+static inline void stats_set(atomic_ulong* counter, unsigned long value) {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void stats_inc(atomic_ulong* counter) {
+    stats_add(counter, 1);
+}
+
+static inline void stats_max(atomic_ulong* max, unsigned long value) {
+    if (value > stats_read(max)) {
+        stats_set(max, value);
+    }
+}
+
+// Sum the counters of every endpoint and print them; maxima are the largest
+// seen by any one endpoint. RTT and RTO estimates are averaged over the
+// senders with a sample, and inbox lock holds over every endpoint. Safe while
+// the endpoints are running.
+void stats_print(FILE* out);
+
+// Print the stats on SIGUSR1. Call before any other thread is created: it
+// blocks the signal in the caller, and every thread inherits that mask, so
+// only the dedicated sigwait thread ever takes it.
+void stats_start_signal_thread(void);
+
+#endif
@@ -0,0 +1,138 @@
+#include "timer.h"
+
+#include <stddef.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static inline long timer_tick(long usec) { return usec / TIMER_WHEEL_TICK_USEC; }
+
+static void timer_list_init(TimerEntry* sentinel) {
+    sentinel->prev = sentinel;
+    sentinel->next = sentinel;
+}
+
+static void timer_list_unlink(TimerEntry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void timer_list_append(TimerEntry* sentinel, TimerEntry* entry) {
+    entry->prev = sentinel->prev;
+    entry->next = sentinel;
+    sentinel->prev->next = entry;
+    sentinel->prev = entry;
+}
+
+void timer_wheel_init(TimerWheel* wheel, long now) {
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        timer_list_init(&wheel->slots[i]);
+    }
+    wheel->current_tick = timer_tick(now);
+    wheel->count = 0;
+}
+
+void timer_wheel_insert(TimerWheel* wheel, TimerEntry* entry, long deadline) {
+    if (entry->armed) {
+        timer_wheel_cancel(wheel, entry);
+    }
+
+    // Overdue timers go into the current slot so the next expiry sees them
+    long tick = timer_tick(deadline);
+    if (tick < wheel->current_tick) {
+        tick = wheel->current_tick;
+    }
+    entry->deadline = deadline;
+    entry->armed = 1;
+    timer_list_append(&wheel->slots[tick & TIMER_WHEEL_MASK], entry);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel* wheel, TimerEntry* entry) {
+    if (!entry->armed) {
+        return;
+    }
+    timer_list_unlink(entry);
+    entry->armed = 0;
+    wheel->count--;
+}
+
+void timer_wheel_expire(TimerWheel* wheel, long now,
+                        void (*expired)(TimerEntry*, void*), void* arg) {
+    TimerEntry due;
+    long target_tick = timer_tick(now);
+    long ticks = target_tick - wheel->current_tick + 1;
+
+    if (wheel->count == 0) {
+        if (target_tick > wheel->current_tick) {
+            wheel->current_tick = target_tick;
+        }
+        return;
+    }
+
+    // Collect first so callbacks can re-arm without being seen again
+    timer_list_init(&due);
+    if (ticks > TIMER_WHEEL_SLOTS) {
+        ticks = TIMER_WHEEL_SLOTS;
+    }
+    for (long t = 0; t < ticks; t++) {
+        TimerEntry* slot =
+            &wheel->slots[(wheel->current_tick + t) & TIMER_WHEEL_MASK];
+        TimerEntry* entry = slot->next;
+        while (entry != slot) {
+            TimerEntry* next = entry->next;
+            if (entry->deadline <= now) {
+                timer_list_unlink(entry);
+                entry->armed = 0;
+                wheel->count--;
+                timer_list_append(&due, entry);
+            }
+            entry = next;
+        }
+    }
+    if (target_tick > wheel->current_tick) {
+        wheel->current_tick = target_tick;
+    }
+
+    while (due.next != &due) {
+        TimerEntry* entry = due.next;
+        timer_list_unlink(entry);
+        expired(entry, arg);
+    }
+}
+
+long timer_wheel_next_deadline(TimerWheel* wheel) {
+    long earliest = -1;
+
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // Walk forward one revolution; the first slot holding a timer for its
+    // own tick (or an overdue one) contains the earliest deadline
+    for (long t = 0; t < TIMER_WHEEL_SLOTS; t++) {
+        long tick = wheel->current_tick + t;
+        TimerEntry* slot = &wheel->slots[tick & TIMER_WHEEL_MASK];
+        for (TimerEntry* entry = slot->next; entry != slot; entry = entry->next) {
+            if (timer_tick(entry->deadline) <= tick &&
+                (earliest < 0 || entry->deadline < earliest)) {
+                earliest = entry->deadline;
+            }
+        }
+        if (earliest >= 0) {
+            return earliest;
+        }
+    }
+
+    // Everything is more than a revolution away
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        TimerEntry* slot = &wheel->slots[i];
+        for (TimerEntry* entry = slot->next; entry != slot; entry = entry->next) {
+            if (earliest < 0 || entry->deadline < earliest) {
+                earliest = entry->deadline;
+            }
+        }
+    }
+    return earliest;
+}
@@ -0,0 +1,40 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+// Hashed timing wheel: a timer lands in slot (deadline / tick) & mask and
+// keeps its absolute deadline, so insert and cancel are O(1) and expiry only
+// looks at the slots the clock has moved past.
+#define TIMER_WHEEL_SLOTS 256
+#define TIMER_WHEEL_TICK_USEC 1000
+
+struct TimerEntry_t {
+    struct TimerEntry_t* prev;
+    struct TimerEntry_t* next;
+    long deadline;
+    uint32_t id;
+    unsigned char armed;
+};
+typedef struct TimerEntry_t TimerEntry;
+
+struct TimerWheel_t {
+    TimerEntry slots[TIMER_WHEEL_SLOTS];
+    long current_tick;
+    int count;
+};
+typedef struct TimerWheel_t TimerWheel;
+
+void timer_wheel_init(TimerWheel*, long now);
+void timer_wheel_insert(TimerWheel*, TimerEntry*, long deadline);
+void timer_wheel_cancel(TimerWheel*, TimerEntry*);
+
+// Unlink every timer whose deadline is <= now and hand it to expired(), in no
+// particular order. The callback may re-insert the entry.
+void timer_wheel_expire(TimerWheel*, long now,
+                        void (*expired)(TimerEntry*, void*), void* arg);
+
+// Earliest pending deadline, or -1 when the wheel is empty
+long timer_wheel_next_deadline(TimerWheel*);
+
+#endif
@@ -1,5 +1,13 @@
+// clock_gettime and CLOCK_MONOTONIC are POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
 #include "util.h"
 
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 // Linked list functions
 int ll_get_length(LLnode* head) {
     LLnode* tmp;
@@ -27,7 +35,7 @@ void ll_append_node(LLnode** head_ptr, void* value) {
 
     // Init the value pntr
     head = (*head_ptr);
-    new_node = (LLnode*) malloc(sizeof(LLnode));
+    new_node = (LLnode*) pool_alloc(&node_pool);
     new_node->value = value;
 
     // The list is empty, no node is currently present
@@ -90,11 +98,156 @@ LLnode* ll_pop_node(LLnode** head_ptr) {
     }
 }
 
+// Detach the entire list in O(1); *head_ptr is left empty
+LLnode* ll_splice(LLnode** head_ptr) {
+    LLnode* head = (*head_ptr);
+    (*head_ptr) = NULL;
+    return head;
+}
+
+void ll_list_init(LLlist* list) {
+    list->head = NULL;
+    list->length = 0;
+}
+
+void ll_list_append(LLlist* list, void* value) {
+    ll_append_node(&list->head, value);
+    list->length++;
+}
+
+LLnode* ll_list_pop(LLlist* list) {
+    LLnode* node = ll_pop_node(&list->head);
+    if (node != NULL) {
+        list->length--;
+    }
+    return node;
+}
+
+// Move every node out of list in O(1), leaving it empty
+LLlist ll_list_splice(LLlist* list) {
+    LLlist spliced = *list;
+    ll_list_init(list);
+    return spliced;
+}
+
+// Append all of src to the tail of dst in O(1), leaving src empty
+void ll_list_concat(LLlist* dst, LLlist* src) {
+    if (src->head == NULL) {
+        return;
+    }
+    if (dst->head == NULL) {
+        *dst = ll_list_splice(src);
+        return;
+    }
+    LLnode* dst_tail = dst->head->prev;
+    LLnode* src_tail = src->head->prev;
+    dst_tail->next = src->head;
+    src->head->prev = dst_tail;
+    src_tail->next = dst->head;
+    dst->head->prev = src_tail;
+    dst->length += src->length;
+    ll_list_init(src);
+}
+
+#define PEER_TABLE_INITIAL_CAPACITY 4
+
+static inline uint32_t peer_table_bucket(PeerTable* table, uint16_t id) {
+    // Fibonacci hashing spreads consecutive ids across the table
+    return (uint32_t) (id * 2654435769u >> 16) & table->mask;
+}
+
+static void peer_table_alloc(PeerTable* table, uint32_t capacity) {
+    table->keys = calloc(capacity, sizeof(uint16_t));
+    table->values = calloc(capacity, sizeof(void*));
+    assert(table->keys && table->values);
+    table->mask = capacity - 1;
+    table->length = 0;
+}
+
+void peer_table_init(PeerTable* table) {
+    peer_table_alloc(table, PEER_TABLE_INITIAL_CAPACITY);
+}
+
+void* peer_table_get(PeerTable* table, uint16_t id) {
+    uint32_t bucket = peer_table_bucket(table, id);
+    while (table->values[bucket] != NULL) {
+        if (table->keys[bucket] == id) {
+            return table->values[bucket];
+        }
+        bucket = (bucket + 1) & table->mask;
+    }
+    return NULL;
+}
+
+void peer_table_put(PeerTable* table, uint16_t id, void* value) {
+    // Keep the load factor at or below one half
+    if (2 * (table->length + 1) > table->mask + 1) {
+        PeerTable grown;
+        peer_table_alloc(&grown, 2 * (table->mask + 1));
+        for (uint32_t i = 0; i <= table->mask; i++) {
+            if (table->values[i] != NULL) {
+                peer_table_put(&grown, table->keys[i], table->values[i]);
+            }
+        }
+        free(table->keys);
+        free(table->values);
+        *table = grown;
+    }
+
+    uint32_t bucket = peer_table_bucket(table, id);
+    while (table->values[bucket] != NULL) {
+        bucket = (bucket + 1) & table->mask;
+    }
+    table->keys[bucket] = id;
+    table->values[bucket] = value;
+    table->length++;
+}
+
+void* peer_table_remove(PeerTable* table, uint16_t id) {
+    uint32_t hole = peer_table_bucket(table, id);
+    while (table->values[hole] != NULL && table->keys[hole] != id) {
+        hole = (hole + 1) & table->mask;
+    }
+    void* value = table->values[hole];
+    if (value == NULL) {
+        return NULL;
+    }
+    table->values[hole] = NULL;
+    table->length--;
+
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // hole unless that would put them before their home bucket
+    uint32_t bucket = (hole + 1) & table->mask;
+    while (table->values[bucket] != NULL) {
+        uint32_t home = peer_table_bucket(table, table->keys[bucket]);
+        if (((bucket - home) & table->mask) >= ((bucket - hole) & table->mask)) {
+            table->keys[hole] = table->keys[bucket];
+            table->values[hole] = table->values[bucket];
+            table->values[bucket] = NULL;
+            hole = bucket;
+        }
+        bucket = (bucket + 1) & table->mask;
+    }
+    return value;
+}
+
+void peer_table_destroy(PeerTable* table, void (*free_value)(void*)) {
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        if (table->values[i] != NULL) {
+            free_value(table->values[i]);
+        }
+    }
+    free(table->keys);
+    free(table->values);
+}
+
+void ll_free_node(LLnode* node) { pool_free(&node_pool, node); }
+
 void ll_destroy_node(LLnode* node) {
     if (node->type == llt_string) {
         free((char*) node->value);
     }
-    free(node);
+    ll_free_node(node);
 }
 
 // Compute the difference in usec for two timeval objects
@@ -105,75 +258,397 @@ long timeval_usecdiff(struct timeval* start_time, struct timeval* finish_time) {
     return usec;
 }
 
+// Current time as a single usec count
+long current_time_usec(void) {
+    if (glb_sysconfig.simulate) {
+        return sim_now();
+    }
+    return monotonic_time_nsec() / 1000;
+}
+
+long monotonic_time_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void latch_init(Latch* latch, int count) {
+    pthread_mutex_init(&latch->mutex, NULL);
+    pthread_cond_init(&latch->cv, NULL);
+    latch->count = count;
+}
+
+void latch_count_down(Latch* latch) {
+    pthread_mutex_lock(&latch->mutex);
+    if (--latch->count == 0) {
+        pthread_cond_broadcast(&latch->cv);
+    }
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void latch_wait(Latch* latch) {
+    pthread_mutex_lock(&latch->mutex);
+    while (latch->count > 0) {
+        pthread_cond_wait(&latch->cv, &latch->mutex);
+    }
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void latch_destroy(Latch* latch) {
+    pthread_mutex_destroy(&latch->mutex);
+    pthread_cond_destroy(&latch->cv);
+}
+
 // Print out messages entered by the user
 void print_cmd(Cmd* cmd) {
     fprintf(stderr, "src=%d, dst=%d, message=%s\n", cmd->src_id, cmd->dst_id,
             cmd->message);
 }
 
-// Encrypt char buffer with CRC-32
-void crc_encrypt(char* char_buf) {
-    size_t frameSize = sizeof(Frame);
-    char* remainder = malloc(frameSize);
-    memcpy(remainder, char_buf, frameSize);
-
-    // Calculate remainder (Divide).
-    for (size_t i = 0; i < frameSize - 4; i++) {
-        for (int j = 0; j < 8; j++) {
-            if ((remainder[i] & (0x80 >> j)) == 0) continue;
-            remainder[i] ^= ((CRC_GENERATOR >> (4 * 8 + j)) & 0xFF);
-            remainder[i + 1] ^= ((CRC_GENERATOR >> (3 * 8 + j)) & 0xFF);
-            remainder[i + 2] ^= ((CRC_GENERATOR >> (2 * 8 + j)) & 0xFF);
-            remainder[i + 3] ^= ((CRC_GENERATOR >> (1 * 8 + j)) & 0xFF);
-            remainder[i + 4] ^= ((CRC_GENERATOR >> j) & 0xFF);
+// Size the message for the file bytes from chunk_start on, and say in its
+// last head byte whether more chunks follow
+static void cmd_set_chunk(Cmd* cmd) {
+    uint64_t rest = cmd->map_length - cmd->chunk_start;
+    uint32_t chunk = rest > FILE_CHUNK_SIZE ? FILE_CHUNK_SIZE : rest;
+    cmd->message[cmd->head_length - 1] = rest > chunk;
+    cmd->length = cmd->head_length + chunk;
+}
+
+int cmd_map_file(Cmd* cmd, const char* path) {
+    struct stat file_stat;
+
+    // Receivers only learn the base name, cut to fit in the first fragment
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    size_t name_length = strlen(name);
+    if (name_length == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "%s: not a file name\n", path);
+        return -1;
+    }
+    // The name, its NUL and the chain byte must fit in the first fragment
+    if (name_length > FRAME_MIN_PAYLOAD_SIZE - 2) {
+        name_length = FRAME_MIN_PAYLOAD_SIZE - 2;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &file_stat) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // mmap rejects empty mappings
+    cmd->map = NULL;
+    cmd->map_length = file_stat.st_size;
+    if (cmd->map_length > 0) {
+        cmd->map = mmap(NULL, cmd->map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (cmd->map == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
         }
+        posix_madvise(cmd->map, cmd->map_length, POSIX_MADV_SEQUENTIAL);
     }
+    // The mapping outlives the descriptor
+    close(fd);
 
-    // Subtract remainder.
-    for (size_t i = frameSize - 4; i < frameSize; i++) {
-        char_buf[i] ^= remainder[i];
+    cmd->message = malloc(name_length + 2);
+    assert(cmd->message);
+    memcpy(cmd->message, name, name_length);
+    cmd->message[name_length] = '\0';
+    cmd->head_length = name_length + 2;
+    cmd->chunk_start = 0;
+    cmd->file = 1;
+    cmd_set_chunk(cmd);
+    return 0;
+}
+
+int cmd_next_chunk(Cmd* cmd) {
+    uint64_t chunk_end = cmd->chunk_start + (cmd->length - cmd->head_length);
+    if (!cmd->file || chunk_end == cmd->map_length) {
+        return 0;
     }
+    // Later chunks go by an empty name
+    cmd->message[0] = '\0';
+    cmd->head_length = 2;
+    cmd->chunk_start = chunk_end;
+    cmd_set_chunk(cmd);
+    return 1;
+}
 
-    free(remainder);
+void cmd_free(Cmd* cmd) {
+    if (cmd->map != NULL) {
+        munmap(cmd->map, cmd->map_length);
+    }
+    free(cmd->message);
+    free(cmd);
+}
+
+// Encrypt char buffer with CRC-32
+void crc_encrypt(char* char_buf) {
+    unsigned char* buf = (unsigned char*) char_buf;
+    uint32_t crc = crc_compute(buf, CRC_COVERED_SIZE);
+
+    // Subtract remainder.
+    for (int i = 0; i < CRC_SIZE; i++) {
+        buf[CRC_COVERED_SIZE + i] = (unsigned char) (crc >> (24 - 8 * i));
+    }
 }
 
 // Decrypt char buffer with CRC-32
 void crc_decrypt(char* char_buf) {
-    size_t frameSize = sizeof(Frame);
-    char* remainder = malloc(frameSize);
-    memcpy(remainder, char_buf, frameSize);
-
-    // Calculate remainder (Divide).
-    for (size_t i = 0; i < frameSize - 4; i++) {
-        for (int j = 0; j < 8; j++) {
-            if ((remainder[i] & (0x80 >> j)) == 0) continue;
-            remainder[i] ^= ((CRC_GENERATOR >> (4 * 8 + j)) & 0xFF);
-            remainder[i + 1] ^= ((CRC_GENERATOR >> (3 * 8 + j)) & 0xFF);
-            remainder[i + 2] ^= ((CRC_GENERATOR >> (2 * 8 + j)) & 0xFF);
-            remainder[i + 3] ^= ((CRC_GENERATOR >> (1 * 8 + j)) & 0xFF);
-            remainder[i + 4] ^= ((CRC_GENERATOR >> j) & 0xFF);
+    unsigned char* buf = (unsigned char*) char_buf;
+    uint32_t crc = crc_compute(buf, CRC_COVERED_SIZE);
+
+    // Set remainder.
+    for (int i = 0; i < CRC_SIZE; i++) {
+        buf[CRC_COVERED_SIZE + i] ^= (unsigned char) (crc >> (24 - 8 * i));
+    }
+}
+
+// Fixed-width big-endian fields of the plain format
+static unsigned char* put_be(unsigned char* out, uint32_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        *out++ = (unsigned char) (value >> (8 * i));
+    }
+    return out;
+}
+
+static const unsigned char* get_be(const unsigned char* in, uint32_t* value,
+                                   int bytes) {
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        *value = *value << 8 | *in++;
+    }
+    return in;
+}
+
+// Varints of the packed format: 7 bits per byte, low bits first, and the
+// high bit set on every byte but the last
+static unsigned char* put_varint(unsigned char* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+}
+
+static int varint_size(uint32_t value) {
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// NULL if the varint does not end before end
+static const unsigned char* get_varint(const unsigned char* in,
+                                       const unsigned char* end,
+                                       uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; in < end && shift < 32; shift += 7) {
+        unsigned char byte = *in++;
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return in;
         }
     }
+    return NULL;
+}
 
-    // Set remainder.
-    for (size_t i = frameSize - 4; i < frameSize; i++) {
-        char_buf[i] = remainder[i];
+// Packed type byte: the frame type in the low bits, plus PACKED_START on the
+// first fragment of a message, which carries msg_len instead of its offset
+#define PACKED_TYPE_MASK 0x03
+#define PACKED_START 0x04
+static const unsigned char packed_flags[] = { 'd', 'f', 'a' };
+
+static unsigned char packed_type(unsigned char flags) {
+    return flags == 'f' ? 1 : flags == 'a' ? 2 : 0;
+}
+
+static uint32_t packed_header_size(const Frame* frame) {
+    uint32_t size = 1 + SEQ_BITS / 8 + varint_size(frame->src_id) +
+                    varint_size(frame->dst_id);
+    if (frame->flags == 'a') {
+        return size + SEQ_BITS / 8;
+    }
+    return size + varint_size(frame->msg_id) +
+           varint_size(frame->offset == 0 ? frame->msg_len : frame->offset);
+}
+
+// Plain frames only carry msg_id when the message needs more than one, and
+// their offset only past the first; an ACK's msg_len is a seqNum, never a
+// length
+static int plain_fragmented(const Frame* frame) {
+    return frame->flags != 'a' &&
+           (frame->offset != 0 || frame->msg_len > PLAIN_SINGLE_FRAME_SIZE);
+}
+
+uint32_t frame_capacity(const Frame* frame) {
+    if (glb_sysconfig.wire_format == wire_packed) {
+        return FRAME_DATA_CAPACITY - packed_header_size(frame);
+    }
+    return plain_fragmented(frame) ? FRAME_PAYLOAD_SIZE
+                                   : PLAIN_SINGLE_FRAME_SIZE;
+}
+
+// Parse a packed header into frame; returns where the data starts, or NULL
+// if the header runs past end
+static const unsigned char* packed_decode_header(const unsigned char* in,
+                                                 const unsigned char* end,
+                                                 Frame* frame) {
+    unsigned char type = *in & PACKED_TYPE_MASK;
+    int start = *in++ & PACKED_START;
+    uint32_t value;
+
+    frame->flags = type < sizeof(packed_flags) ? packed_flags[type] : 0;
+    in = get_be(in, &value, SEQ_BITS / 8);
+    frame->seqNum = (seq_t) value;
+    frame->msg_len = 0;
+    frame->offset = 0;
+    frame->msg_id = 0;
+    if ((in = get_varint(in, end, &value)) == NULL) {
+        return NULL;
+    }
+    frame->src_id = (uint16_t) value;
+    if ((in = get_varint(in, end, &value)) == NULL) {
+        return NULL;
+    }
+    frame->dst_id = (uint16_t) value;
+
+    if (frame->flags == 'a') {
+        return end - in >= SEQ_BITS / 8
+                   ? get_be(in, &frame->msg_len, SEQ_BITS / 8)
+                   : NULL;
+    }
+    if ((in = get_varint(in, end, &value)) == NULL) {
+        return NULL;
+    }
+    frame->msg_id = (uint16_t) value;
+    return get_varint(in, end, start ? &frame->msg_len : &frame->offset);
+}
+
+// Serialize frame into a MAX_FRAME_SIZE wire buffer owned by the caller
+void frame_encode(Frame* frame, char* char_buf) {
+    unsigned char* out = (unsigned char*) char_buf;
+
+    if (glb_sysconfig.wire_format == wire_packed) {
+        int start = frame->flags != 'a' && frame->offset == 0;
+        *out++ = packed_type(frame->flags) | (start ? PACKED_START : 0);
+        out = put_be(out, frame->seqNum, SEQ_BITS / 8);
+        out = put_varint(out, frame->src_id);
+        out = put_varint(out, frame->dst_id);
+        if (frame->flags == 'a') {
+            out = put_be(out, frame->msg_len, SEQ_BITS / 8);
+        } else {
+            out = put_varint(out, frame->msg_id);
+            out = put_varint(out, start ? frame->msg_len : frame->offset);
+        }
+    } else {
+        int continued = frame->flags != 'a' && frame->offset != 0;
+        *out++ = frame->flags | (continued ? PLAIN_CONTINUED : 0);
+        out = put_be(out, frame->seqNum, SEQ_BITS / 8);
+        out = put_be(out, frame->src_id, 2);
+        out = put_be(out, frame->dst_id, 2);
+        out = put_be(out, continued ? frame->offset : frame->msg_len, 4);
+        if (plain_fragmented(frame)) {
+            out = put_be(out, frame->msg_id, 2);
+        }
+    }
+
+    uint32_t capacity = (unsigned char*) char_buf + CRC_COVERED_SIZE - out;
+    uint32_t length =
+        frame->data_length < capacity ? frame->data_length : capacity;
+    memcpy(out, frame->data, length);
+    memset(out + length, 0, capacity - length);
+    crc_encrypt(char_buf);
+}
+
+// Deserialize a wire buffer into a frame owned by the caller. The buffer is
+// not modified; frame->remainder is 0 iff the CRC matched, and the other
+// fields are only filled in if it did.
+void frame_decode(const char* char_buf, Frame* frame) {
+    const unsigned char* in = (const unsigned char*) char_buf;
+    const unsigned char* end = in + CRC_COVERED_SIZE;
+    uint32_t value;
+
+    get_be(end, &frame->remainder, CRC_SIZE);
+    frame->remainder ^= crc_compute(in, CRC_COVERED_SIZE);
+    if (frame->remainder != 0) {
+        return;
     }
 
-    free(remainder);
+    if (glb_sysconfig.wire_format == wire_packed) {
+        in = packed_decode_header(in, end, frame);
+        // Only a bug on the sending side gets a bad header past the CRC
+        if (in == NULL) {
+            frame->remainder = 1;
+            return;
+        }
+    } else {
+        int continued = *in & PLAIN_CONTINUED;
+        frame->flags = *in++ & ~PLAIN_CONTINUED;
+        in = get_be(in, &value, SEQ_BITS / 8);
+        frame->seqNum = (seq_t) value;
+        in = get_be(in, &value, 2);
+        frame->src_id = (uint16_t) value;
+        in = get_be(in, &value, 2);
+        frame->dst_id = (uint16_t) value;
+        frame->msg_len = 0;
+        frame->offset = 0;
+        frame->msg_id = 0;
+        in = get_be(in, continued ? &frame->offset : &frame->msg_len, 4);
+        if (plain_fragmented(frame)) {
+            in = get_be(in, &value, 2);
+            frame->msg_id = (uint16_t) value;
+        }
+    }
+
+    frame->data_length = end - in;
+    memcpy(frame->data, in, frame->data_length);
+}
+
+// The ids of a frame still on the wire, without checking its CRC: the link
+// routes and counts frames before it has a chance to corrupt them
+void frame_peek_ids(const char* char_buf, uint16_t* src_id, uint16_t* dst_id) {
+    const unsigned char* in = (const unsigned char*) char_buf + 1 + SEQ_BITS / 8;
+    const unsigned char* end = (const unsigned char*) char_buf + CRC_COVERED_SIZE;
+    uint32_t value = 0;
+
+    if (glb_sysconfig.wire_format == wire_packed) {
+        in = get_varint(in, end, &value);
+        *src_id = (uint16_t) value;
+        if (in != NULL) {
+            get_varint(in, end, &value);
+        }
+        *dst_id = (uint16_t) value;
+    } else {
+        in = get_be(in, &value, 2);
+        *src_id = (uint16_t) value;
+        get_be(in, &value, 2);
+        *dst_id = (uint16_t) value;
+    }
 }
 
 char* convert_frame_to_char(Frame* frame) {
-    frame->remainder = 0;
-    char* char_buffer = malloc(sizeof(Frame));
-    memcpy(char_buffer, frame, sizeof(Frame));
-    crc_encrypt(char_buffer);
+    char* char_buffer = wire_alloc();
+    frame_encode(frame, char_buffer);
     return char_buffer;
 }
 
 Frame* convert_char_to_frame(char* char_buf) {
-    crc_decrypt(char_buf);
-    Frame* frame = malloc(sizeof(Frame));
-    memcpy(frame, char_buf, sizeof(Frame));
+    Frame* frame = frame_alloc();
+    frame_decode(char_buf, frame);
     return frame;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define __UTIL_H__
 
 #include "common.h"
+#include "crc.h"
+#include "pool.h"
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -19,15 +21,81 @@ int ll_get_length(LLnode*);
 void ll_append_node(LLnode**, void*);
 LLnode* ll_pop_node(LLnode**);
 LLnode* ll_get_node(LLnode** head_ptr, int index);
+void ll_free_node(LLnode*);
 void ll_destroy_node(LLnode*);
+LLnode* ll_splice(LLnode**);
+
+// Counted list functions
+void ll_list_init(LLlist*);
+void ll_list_append(LLlist*, void*);
+LLnode* ll_list_pop(LLlist*);
+LLlist ll_list_splice(LLlist*);
+void ll_list_concat(LLlist*, LLlist*);
+
+// Peer table functions
+void peer_table_init(PeerTable*);
+// NULL when id has no entry
+void* peer_table_get(PeerTable*, uint16_t id);
+// id must not have an entry yet
+void peer_table_put(PeerTable*, uint16_t id, void* value);
+// Returns the value that was stored under id, NULL if there was none
+void* peer_table_remove(PeerTable*, uint16_t id);
+// Hands every value to free_value
+void peer_table_destroy(PeerTable*, void (*free_value)(void*));
+
+// Serial-number arithmetic (RFC 1982) on seq_t; only meaningful while the
+// two numbers are less than SEQ_SPACE / 2 apart
+static inline uint32_t seq_offset(seq_t from, seq_t to) {
+    return (seq_t) (to - from);
+}
+
+static inline int seq_lt(seq_t a, seq_t b) {
+    return a != b && seq_offset(a, b) < SEQ_SPACE / 2;
+}
+
+static inline int seq_le(seq_t a, seq_t b) { return a == b || seq_lt(a, b); }
+
+// Nonzero iff seq lies in [base, base + length)
+static inline int seq_in_window(seq_t seq, seq_t base, uint32_t length) {
+    return seq_offset(base, seq) < length;
+}
+
+// Latch functions
+void latch_init(Latch*, int count);
+void latch_count_down(Latch*);
+void latch_wait(Latch*);
+void latch_destroy(Latch*);
 
 // Print functions
 void print_cmd(Cmd*);
+// Make cmd send the file at path: maps it and sets message to the head of
+// its first chunk. Prints why and returns -1 if the file can't be sent.
+int cmd_map_file(Cmd* cmd, const char* path);
+// Moves a file command on to its next chunk; returns 0 after the last one
+int cmd_next_chunk(Cmd* cmd);
+// Frees the message and unmaps the file, if any
+void cmd_free(Cmd*);
 
 // Time functions
 long timeval_usecdiff(struct timeval*, struct timeval*);
+// Both on CLOCK_MONOTONIC: protocol deadlines and RTTs are immune to wall
+// clock adjustments
+long current_time_usec(void);
+long monotonic_time_nsec(void);
+
+// CRC functions
+void crc_encrypt(char*);
+void crc_decrypt(char*);
+
+// In-place codec for glb_sysconfig.wire_format: both sides are
+// caller-owned, nothing is allocated
+void frame_encode(Frame*, char*);
+void frame_decode(const char*, Frame*);
+// How many data bytes fit next to the header of frame as it stands
+uint32_t frame_capacity(const Frame*);
+void frame_peek_ids(const char*, uint16_t* src_id, uint16_t* dst_id);
 
-// TODO: Implement these functions
+// Allocating wrappers around the codec (pool-backed)
 char* convert_frame_to_char(Frame*);
 Frame* convert_char_to_frame(char*);
 #endif
@@ -0,0 +1,333 @@
+// CLOCK_MONOTONIC and pthread_condattr_setclock are POSIX, hidden by -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include "workpool.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// One worker thread and its deque, a circular list around a sentinel task.
+// The owner pushes and pops at the bottom (deque.prev); thieves take from
+// the top (deque.next), which is also where yielded tasks go.
+struct Worker_t {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    Task deque;
+};
+typedef struct Worker_t Worker;
+
+struct WorkerPool_t {
+    Worker* workers;
+    int workers_length;
+    // Tasks sitting in some deque; idle workers sleep while it is zero
+    atomic_int queued;
+    atomic_int idle;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cv;
+    atomic_int stopping;
+    // Spreads tasks woken from outside the pool (stdin, timers, main)
+    atomic_uint next_worker;
+    // Deadlines of parked tasks, fired by run_timers
+    pthread_t timer_thread;
+    pthread_mutex_t timer_mutex;
+    pthread_cond_t timer_cv;
+    TimerWheel timer_wheel;
+    // What run_timers is sleeping until, -1 for no deadline
+    long timer_sleep_deadline;
+};
+
+static struct WorkerPool_t worker_pool;
+static _Thread_local Worker* current_worker;
+
+static void deque_push(Worker* worker, Task* task, int top) {
+    Task* sentinel = &worker->deque;
+    Task* before = top ? sentinel : sentinel->prev;
+    task->prev = before;
+    task->next = before->next;
+    before->next->prev = task;
+    before->next = task;
+}
+
+static Task* deque_pop(Worker* worker, int top) {
+    Task* sentinel = &worker->deque;
+    Task* task = top ? sentinel->next : sentinel->prev;
+    if (task == sentinel) {
+        return NULL;
+    }
+    task->prev->next = task->next;
+    task->next->prev = task->prev;
+    return task;
+}
+
+static void sim_run_task(void* target, void* value) {
+    Task* task = target;
+    (void) value;
+    atomic_store(&task->state, task_running);
+    task->run(task);
+}
+
+// Queue on the current worker, or spread over all of them from outside.
+// Under --simulate the task runs as an event at the current virtual time.
+static void task_enqueue(Task* task, int top) {
+    if (glb_sysconfig.simulate) {
+        atomic_store(&task->state, task_scheduled);
+        sim_at(sim_now(), sim_run_task, task, NULL);
+        return;
+    }
+
+    Worker* worker = current_worker;
+    if (worker == NULL) {
+        unsigned next = atomic_fetch_add(&worker_pool.next_worker, 1);
+        worker = &worker_pool.workers[next % worker_pool.workers_length];
+    }
+
+    atomic_store(&task->state, task_scheduled);
+    pthread_mutex_lock(&worker->mutex);
+    deque_push(worker, task, top);
+    pthread_mutex_unlock(&worker->mutex);
+
+    // Pairs with worker_idle: either it sees queued > 0 or we see it idle
+    atomic_fetch_add(&worker_pool.queued, 1);
+    if (atomic_load(&worker_pool.idle) > 0) {
+        pthread_mutex_lock(&worker_pool.idle_mutex);
+        pthread_cond_signal(&worker_pool.idle_cv);
+        pthread_mutex_unlock(&worker_pool.idle_mutex);
+    }
+}
+
+// Waker callback: queue a parked task, or tell a running one to go again
+static void task_notify(void* arg) {
+    Task* task = arg;
+    int state = atomic_load(&task->state);
+
+    while (1) {
+        if (state == task_idle) {
+            if (atomic_compare_exchange_weak(&task->state, &state,
+                                             task_scheduled)) {
+                task_enqueue(task, 0);
+                return;
+            }
+        } else if (state == task_running) {
+            if (atomic_compare_exchange_weak(&task->state, &state,
+                                             task_notified)) {
+                return;
+            }
+        } else {
+            // Already queued, or already told
+            return;
+        }
+    }
+}
+
+static void task_timedout(TimerEntry* timer, void* arg) {
+    (void) arg;
+    task_notify(container_of(timer, Task, timer));
+}
+
+// Simulated timer; stale unless the task still waits for this deadline
+static void sim_task_timedout(void* target, void* value) {
+    Task* task = target;
+    (void) value;
+    if (task->timer_deadline == sim_now()) {
+        task_notify(task);
+    }
+}
+
+void task_init(Task* task, MpscWaker* waker, void (*run)(Task*)) {
+    task->prev = NULL;
+    task->next = NULL;
+    atomic_init(&task->state, task_idle);
+    task->run = run;
+    task->timer.prev = NULL;
+    task->timer.next = NULL;
+    task->timer.armed = 0;
+    task->timer_deadline = -1;
+
+    atomic_init(&waker->parked, 0);
+    waker->event_fd = -1;
+    waker->notify = task_notify;
+    waker->notify_arg = task;
+}
+
+void task_park(Task* task, long deadline_usec) {
+    if (deadline_usec >= 0 && deadline_usec <= current_time_usec()) {
+        task_yield(task);
+        return;
+    }
+
+    if (glb_sysconfig.simulate) {
+        // A deadline still in the future is already queued as an event
+        if (deadline_usec >= 0 && deadline_usec != task->timer_deadline) {
+            sim_at(deadline_usec, sim_task_timedout, task, NULL);
+        }
+        task->timer_deadline = deadline_usec;
+    } else if (deadline_usec >= 0 || task->timer_deadline >= 0) {
+        // Arm before going idle: once idle the task may already be running
+        // on another worker
+        pthread_mutex_lock(&worker_pool.timer_mutex);
+        if (deadline_usec >= 0) {
+            timer_wheel_insert(&worker_pool.timer_wheel, &task->timer,
+                               deadline_usec);
+            if (worker_pool.timer_sleep_deadline < 0 ||
+                deadline_usec < worker_pool.timer_sleep_deadline) {
+                pthread_cond_signal(&worker_pool.timer_cv);
+            }
+        } else {
+            timer_wheel_cancel(&worker_pool.timer_wheel, &task->timer);
+        }
+        pthread_mutex_unlock(&worker_pool.timer_mutex);
+        task->timer_deadline = deadline_usec;
+    }
+
+    int running = task_running;
+    if (!atomic_compare_exchange_strong(&task->state, &running, task_idle)) {
+        // Notified while running: whatever arrived has not been seen yet
+        task_enqueue(task, 0);
+    }
+}
+
+void task_yield(Task* task) { task_enqueue(task, 1); }
+
+// Own deque first (newest work, warm caches), then steal the oldest task
+// from the others
+static Task* worker_take(Worker* self) {
+    int self_index = self - worker_pool.workers;
+    Task* task = NULL;
+
+    for (int i = 0; task == NULL && i < worker_pool.workers_length; i++) {
+        Worker* victim =
+            &worker_pool.workers[(self_index + i) % worker_pool.workers_length];
+        pthread_mutex_lock(&victim->mutex);
+        task = deque_pop(victim, victim != self);
+        pthread_mutex_unlock(&victim->mutex);
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&worker_pool.queued, 1);
+    }
+    return task;
+}
+
+static void worker_idle(void) {
+    pthread_mutex_lock(&worker_pool.idle_mutex);
+    atomic_fetch_add(&worker_pool.idle, 1);
+    while (atomic_load(&worker_pool.queued) == 0 &&
+           !atomic_load(&worker_pool.stopping)) {
+        pthread_cond_wait(&worker_pool.idle_cv, &worker_pool.idle_mutex);
+    }
+    atomic_fetch_sub(&worker_pool.idle, 1);
+    pthread_mutex_unlock(&worker_pool.idle_mutex);
+}
+
+static void* run_worker(void* arg) {
+    Worker* self = arg;
+    current_worker = self;
+
+    while (!atomic_load(&worker_pool.stopping)) {
+        Task* task = worker_take(self);
+        if (task == NULL) {
+            worker_idle();
+            continue;
+        }
+        atomic_store(&task->state, task_running);
+        task->run(task);
+    }
+    return NULL;
+}
+
+static void* run_timers(void* arg) {
+    struct timespec wake_at;
+    (void) arg;
+
+    pthread_mutex_lock(&worker_pool.timer_mutex);
+    while (!atomic_load(&worker_pool.stopping)) {
+        timer_wheel_expire(&worker_pool.timer_wheel, current_time_usec(),
+                           task_timedout, NULL);
+
+        long deadline = timer_wheel_next_deadline(&worker_pool.timer_wheel);
+        worker_pool.timer_sleep_deadline = deadline;
+        if (deadline < 0) {
+            pthread_cond_wait(&worker_pool.timer_cv, &worker_pool.timer_mutex);
+        } else {
+            // timer_cv runs on CLOCK_MONOTONIC, like the deadlines
+            wake_at.tv_sec = deadline / 1000000;
+            wake_at.tv_nsec = deadline % 1000000 * 1000;
+            pthread_cond_timedwait(&worker_pool.timer_cv,
+                                   &worker_pool.timer_mutex, &wake_at);
+        }
+    }
+    pthread_mutex_unlock(&worker_pool.timer_mutex);
+    return NULL;
+}
+
+void worker_pool_start(int workers) {
+    pthread_condattr_t timer_cv_attr;
+
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) {
+            workers = 1;
+        }
+    }
+
+    worker_pool.workers = calloc(workers, sizeof(Worker));
+    assert(worker_pool.workers);
+    worker_pool.workers_length = workers;
+    atomic_init(&worker_pool.queued, 0);
+    atomic_init(&worker_pool.idle, 0);
+    pthread_mutex_init(&worker_pool.idle_mutex, NULL);
+    pthread_cond_init(&worker_pool.idle_cv, NULL);
+    atomic_init(&worker_pool.stopping, 0);
+    atomic_init(&worker_pool.next_worker, 0);
+
+    pthread_mutex_init(&worker_pool.timer_mutex, NULL);
+    pthread_condattr_init(&timer_cv_attr);
+    pthread_condattr_setclock(&timer_cv_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&worker_pool.timer_cv, &timer_cv_attr);
+    pthread_condattr_destroy(&timer_cv_attr);
+    timer_wheel_init(&worker_pool.timer_wheel, current_time_usec());
+    worker_pool.timer_sleep_deadline = -1;
+
+    for (int i = 0; i < workers; i++) {
+        Worker* worker = &worker_pool.workers[i];
+        pthread_mutex_init(&worker->mutex, NULL);
+        worker->deque.prev = &worker->deque;
+        worker->deque.next = &worker->deque;
+    }
+    for (int i = 0; i < workers; i++) {
+        int rc = pthread_create(&worker_pool.workers[i].thread, NULL,
+                                run_worker, &worker_pool.workers[i]);
+        assert(rc == 0);
+        (void) rc;
+    }
+    int rc = pthread_create(&worker_pool.timer_thread, NULL, run_timers, NULL);
+    assert(rc == 0);
+    (void) rc;
+}
+
+int worker_pool_get_workers(void) { return worker_pool.workers_length; }
+
+void worker_pool_stop(void) {
+    atomic_store(&worker_pool.stopping, 1);
+
+    pthread_mutex_lock(&worker_pool.idle_mutex);
+    pthread_cond_broadcast(&worker_pool.idle_cv);
+    pthread_mutex_unlock(&worker_pool.idle_mutex);
+    for (int i = 0; i < worker_pool.workers_length; i++) {
+        pthread_join(worker_pool.workers[i].thread, NULL);
+        pthread_mutex_destroy(&worker_pool.workers[i].mutex);
+    }
+
+    pthread_mutex_lock(&worker_pool.timer_mutex);
+    pthread_cond_signal(&worker_pool.timer_cv);
+    pthread_mutex_unlock(&worker_pool.timer_mutex);
+    pthread_join(worker_pool.timer_thread, NULL);
+
+    pthread_mutex_destroy(&worker_pool.idle_mutex);
+    pthread_cond_destroy(&worker_pool.idle_cv);
+    pthread_mutex_destroy(&worker_pool.timer_mutex);
+    pthread_cond_destroy(&worker_pool.timer_cv);
+    free(worker_pool.workers);
+}
@@ -0,0 +1,49 @@
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include "mpsc.h"
+#include "timer.h"
+
+#include <stdatomic.h>
+
+// M:N execution (-w): endpoints become tasks run by a fixed set of worker
+// threads instead of owning one thread each. Every worker has a deque; it
+// runs tasks from the bottom and idle workers steal from the top of the
+// others. A parked task is queued again when something is pushed to its
+// inboxes or its timer fires; state makes sure it is queued at most once and
+// never runs on two workers at the same time. Under --simulate the same
+// tasks run as events on the virtual clock instead, with no threads.
+enum TaskState { task_idle, task_scheduled, task_running, task_notified };
+
+struct Task_t {
+    struct Task_t* prev;
+    struct Task_t* next;
+    atomic_int state;
+    // One round of work. Ends in task_park or task_yield, or in neither when
+    // the task is finished and must never run again.
+    void (*run)(struct Task_t*);
+    // Owned by the pool's timer thread
+    TimerEntry timer;
+    // Deadline last handed to the timer thread, -1 for none
+    long timer_deadline;
+};
+typedef struct Task_t Task;
+
+// workers <= 0 means one per online CPU
+void worker_pool_start(int workers);
+int worker_pool_get_workers(void);
+// Stop the workers and the timer thread; no task runs once this returns
+void worker_pool_stop(void);
+
+// Takes over the waker: pushes to its queues, and mpsc_waker_wake, make the
+// task runnable instead of writing an eventfd. The task starts out parked.
+void task_init(Task*, MpscWaker*, void (*run)(Task*));
+
+// From run: sleep until woken or the monotonic deadline (usec, -1 for none)
+// passes. A wakeup that came in during this run requeues the task at once.
+void task_park(Task*, long deadline_usec);
+
+// From run: still runnable, but let the tasks queued behind it go first
+void task_yield(Task*);
+
+#endif